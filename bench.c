@@ -0,0 +1,370 @@
+#define _DEFAULT_SOURCE  // For -std=c99 and the like, before any system header
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Benchmarks for memdebug.h. Configuration macros can be overridden on the command line
+// to compare settings, for example -DMEMDEBUG_REHASH_STEP=0 for stop-the-world rehashing.
+// Run ./bench to run everything, or ./bench <name> [n] to run one benchmark.
+// (malloc)(n) and (free)(ptr) call the real allocator, since the macros need an argument list.
+
+#define MEMDEBUG 1
+#define PRINT_MEMALLOCS 0
+#include "memdebug.h"
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void print_percentiles(const char* name, uint64_t* samples, size_t n) {
+    qsort(samples, n, sizeof(uint64_t), compare_u64);
+    printf("%-8s p50 %6llu ns  p99 %6llu ns  p99.9 %7llu ns  max %9llu ns\n", name,
+           (unsigned long long)samples[n / 2],
+           (unsigned long long)samples[n - n / 100 - 1],
+           (unsigned long long)samples[n - n / 1000 - 1],
+           (unsigned long long)samples[n - 1]);
+}
+
+/*****************************/
+/* Tracking Latency (p99)    */
+/*****************************/
+
+// Time every malloc() and free() while the table grows from empty to n live pointers.
+static void bench_tracking_latency(size_t n) {
+    void** ptrs = (void**)calloc(n, sizeof(void*));
+    uint64_t* samples = (uint64_t*)calloc(n, sizeof(uint64_t));
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t start = now_ns();
+        ptrs[i] = malloc(16);
+        samples[i] = now_ns() - start;
+    }
+    print_percentiles("malloc", samples, n);
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t start = now_ns();
+        free(ptrs[i]);
+        samples[i] = now_ns() - start;
+    }
+    print_percentiles("free", samples, n);
+
+    (free)(samples);
+    (free)(ptrs);
+}
+
+/*********************/
+/* Hash Policies     */
+/*********************/
+
+// These drive the locked registry's tables directly.
+#if !MEMDEBUG_LOCKFREE
+
+// Addresses handed out by the real malloc(), for hashing without tracking them.
+static void** real_address_stream(size_t n, const char* kind) {
+    void** addrs = (void**)calloc(n, sizeof(void*));
+    unsigned seed = 1;
+    for (size_t i = 0; i < n; i++) {
+        size_t size = 16;
+        if (!strcmp(kind, "mixed"))
+            size = 8 + rand_r(&seed) % 512;
+        else if (!strcmp(kind, "pages"))
+            size = 4096;
+        addrs[i] = (malloc)(size);
+
+        // Free some as we go, so that later addresses reuse the holes.
+        if (!strcmp(kind, "mixed") && i && rand_r(&seed) % 4 == 0) {
+            size_t j = rand_r(&seed) % i;
+            (free)(addrs[j]);
+            addrs[j] = (malloc)(size);
+        }
+    }
+    return addrs;
+}
+
+static void bench_hash_policy(const char* name, size_t (*hash)(void*), void** addrs, size_t n) {
+    // Fill a table to just under the load at which it would grow.
+    size_t capacity = MEMDEBUG_MIN_CAPACITY;
+    while (table_growth_limit(capacity) < n)
+        capacity *= 2;
+    AllocTable table;
+    table_alloc(&table, capacity);
+
+    size_t histogram[5] = {0, 0, 0, 0, 0};
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        MemAlloc alloc = memalloc_make(addrs[i], 16, 0);
+        size_t h = hash(addrs[i]);
+        size_t probe_length;
+        table_set(&table, table_find_insert_slot(&table, h, &probe_length), h, alloc);
+        histogram[probe_length > 5 ? 4 : probe_length - 1]++;
+    }
+    double insert_ns = (double)(now_ns() - start) / (double)n;
+
+    start = now_ns();
+    size_t found = 0;
+    for (size_t i = 0; i < n; i++)
+        found += table_find(&table, addrs[i], hash(addrs[i])) != table.capacity;
+    double find_ns = (double)(now_ns() - start) / (double)n;
+
+    printf("%-10s insert %5.1f ns  find %5.1f ns  groups probed: 1 %5.1f%%  2 %5.1f%%  3 %5.1f%%  4 %5.1f%%  5+ %5.1f%%%s\n",
+           name, insert_ns, find_ns,
+           100.0 * histogram[0] / n, 100.0 * histogram[1] / n, 100.0 * histogram[2] / n,
+           100.0 * histogram[3] / n, 100.0 * histogram[4] / n,
+           found == n ? "" : "  (lookups failed!)");
+    table_free(&table);
+}
+
+static void bench_hash_policies(size_t n) {
+    const char* kinds[] = {"sequential", "mixed", "pages"};
+    for (size_t k = 0; k < 3; k++) {
+        void** addrs = real_address_stream(n, kinds[k]);
+        printf("%zu %s addresses from glibc malloc():\n", n, kinds[k]);
+        bench_hash_policy("fibonacci", ptr_hash_fibonacci, addrs, n);
+        bench_hash_policy("murmur", ptr_hash_murmur, addrs, n);
+        bench_hash_policy("shift", ptr_hash_shift, addrs, n);
+        bench_hash_policy("xorshift", ptr_hash_xorshift, addrs, n);
+        for (size_t i = 0; i < n; i++)
+            (free)(addrs[i]);
+        (free)(addrs);
+    }
+}
+#endif
+
+/******************************/
+/* Heap Report Latency        */
+/******************************/
+
+// Spread allocations over a few call sites, like a real heap.
+static void* alloc_at_site(size_t i) {
+    switch (i % 8) {
+    case 0: return malloc(16);
+    case 1: return malloc(24);
+    case 2: return malloc(32);
+    case 3: return malloc(48);
+    case 4: return malloc(64);
+    case 5: return malloc(96);
+    case 6: return malloc(128);
+    default: return malloc(8);
+    }
+}
+
+static double time_ms(void (*report)(void)) {
+    // The reports go to stdout. Time them without the terminal.
+    fflush(stdout);
+    int saved = dup(1);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, 1);
+    uint64_t start = now_ns();
+    report();
+    fflush(stdout);
+    uint64_t end = now_ns();
+    dup2(saved, 1);
+    close(devnull);
+    close(saved);
+    return (double)(end - start) / 1e6;
+}
+
+static void bench_print_heap(size_t max_n) {
+    for (size_t n = 1000; n <= max_n; n *= 10) {
+        void** ptrs = (void**)calloc(n, sizeof(void*));
+        for (size_t i = 0; i < n; i++)
+            ptrs[i] = alloc_at_site(i);
+
+        double counters = time_ms(print_heap);
+        double exact = time_ms(print_heap_exact);
+
+        // The tables don't shrink, so a scan after most of the heap is freed has to skip the empty space.
+        for (size_t i = 100; i < n; i++)
+            free(ptrs[i]);
+        double sparse = time_ms(print_heap_exact);
+        printf("%8zu live: print_heap %8.3f ms  print_heap_exact %9.3f ms  (%.3f ms once 100 are left)\n", n, counters, exact, sparse);
+
+        for (size_t i = 0; i < 100; i++)
+            free(ptrs[i]);
+        (free)(ptrs);
+    }
+}
+
+/**********************************/
+/* Parallel Heap Scan             */
+/**********************************/
+
+static void bench_scan_threads(size_t n) {
+    void** ptrs = (void**)calloc(n, sizeof(void*));
+    for (size_t i = 0; i < n; i++)
+        ptrs[i] = alloc_at_site(i);
+
+    printf("print_heap_exact with %zu live allocations:\n", n);
+    for (size_t threads = 1; threads <= 8; threads *= 2) {
+        set_heap_scan_threads(threads);
+        printf("%zu threads: %9.3f ms\n", threads, time_ms(print_heap_exact));
+    }
+    set_heap_scan_threads(1);
+
+    for (size_t i = 0; i < n; i++)
+        free(ptrs[i]);
+    (free)(ptrs);
+}
+
+/**********************************/
+/* Mutator Latency During a Dump  */
+/**********************************/
+
+static volatile bool dumping;
+
+// Time malloc()/free() pairs for as long as the dumps run.
+static THREAD_FN(time_mutator, ctx) {
+    uint64_t* samples = (uint64_t*)ctx;
+    size_t n = 0;
+    while (dumping && n < 1000000) {
+        uint64_t start = now_ns();
+        free(malloc(32));
+        samples[n++] = now_ns() - start;
+    }
+    samples[1000000] = n;
+    return 0;
+}
+
+static void bench_dump_latency(size_t n) {
+    void** ptrs = (void**)calloc(n, sizeof(void*));
+    for (size_t i = 0; i < n; i++)
+        ptrs[i] = alloc_at_site(i);
+
+    uint64_t* samples = (uint64_t*)calloc(1000001, sizeof(uint64_t));
+    thread_t mutator;
+    dumping = true;
+    thread_create(&mutator, time_mutator, samples);
+    double dump = 0;
+    for (size_t i = 0; i < 5; i++)
+        dump += time_ms(print_heap_exact);
+    dumping = false;
+    thread_join(mutator);
+
+    printf("malloc/free pairs during print_heap_exact with %zu live allocations (%.1f ms per dump):\n", n, dump / 5);
+    if (samples[1000000])
+        print_percentiles("pair", samples, samples[1000000]);
+
+    (free)(samples);
+    for (size_t i = 0; i < n; i++)
+        free(ptrs[i]);
+    (free)(ptrs);
+}
+
+/***************************/
+/* Forked Heap Dump        */
+/***************************/
+
+// How long the caller stops for a forked dump, and how long the child takes to write it.
+static void bench_fork_dump(size_t max_n) {
+    for (size_t n = 1000; n <= max_n; n *= 10) {
+        void** ptrs = (void**)calloc(n, sizeof(void*));
+        for (size_t i = 0; i < n; i++)
+            ptrs[i] = alloc_at_site(i);
+
+        MemdebugDump dump;
+        uint64_t start = now_ns();
+        if (print_heap_fork("/dev/null", &dump)) {
+            printf("fork() failed.\n");
+            exit(1);
+        }
+        uint64_t forked = now_ns();
+        heap_dump_wait(&dump);
+        uint64_t written = now_ns();
+        printf("%8zu live: caller paused %8.3f ms  report written after %9.3f ms\n", n,
+               (double)(forked - start) / 1e6, (double)(written - start) / 1e6);
+
+        for (size_t i = 0; i < n; i++)
+            free(ptrs[i]);
+        (free)(ptrs);
+    }
+}
+
+/***************************/
+/* Allocation Trace        */
+/***************************/
+
+// Batches of mallocs of mixed sizes at a few call sites, freed in a random order, like test4.c.
+static THREAD_FN(trace_workload, ctx) {
+    size_t n = *(size_t*)ctx;
+    unsigned seed = 1;
+    void* batch[1000];
+    for (size_t done = 0; done < n; done += 1000) {
+        for (size_t i = 0; i < 1000; i++)
+            batch[i] = rand_r(&seed) % 4 ? alloc_at_site(i) : malloc(1 + rand_r(&seed) % 4096);
+        for (size_t i = 1000; i > 0; i--) {
+            size_t j = rand_r(&seed) % i;
+            free(batch[j]);
+            batch[j] = batch[i - 1];
+        }
+    }
+    return 0;
+}
+
+// The size of a trace per event, and what recording one costs the allocating threads. Build with
+// -DMEMDEBUG_TRACE_COMPRESS=0 to compare against writing the blocks uncompressed.
+static void bench_trace(size_t n) {
+    const char* path = "memdebug-bench.trace";
+    for (size_t threads = 1; threads <= 4; threads *= 4) {
+        thread_t workers[4];
+        double ms[2];
+        for (int tracing = 0; tracing < 2; tracing++) {
+            if (tracing && memdebug_trace_start(path)) {
+                printf("Could not start a trace.\n");
+                exit(1);
+            }
+            uint64_t start = now_ns();
+            for (size_t i = 0; i < threads; i++)
+                thread_create(&workers[i], trace_workload, &n);
+            for (size_t i = 0; i < threads; i++)
+                thread_join(workers[i]);
+            if (tracing)
+                memdebug_trace_stop();
+            ms[tracing] = (double)(now_ns() - start) / 1e6;
+        }
+
+        struct stat st;
+        stat(path, &st);
+        remove(path);
+        double events = 2.0 * (double)(n * threads);
+        printf("%zu thread%s, %.0f events: %.2f bytes per event, %.1f ns per event untraced, %.1f ns traced\n",
+               threads, threads == 1 ? "" : "s", events, (double)st.st_size / events,
+               ms[0] * 1e6 / events, ms[1] * 1e6 / events);
+#if MEMDEBUG_TRACE_COMPRESS
+        printf("    %.2f bytes per event before compression, %.2fx smaller, compressing took %.1f ns per event (%.0f MB/s)\n",
+               (double)trace_totals.raw_bytes / events, (double)trace_totals.raw_bytes / (double)trace_totals.file_bytes,
+               (double)trace_totals.compress_ns / events, (double)trace_totals.raw_bytes * 1e3 / (double)(trace_totals.compress_ns + 1));
+#endif
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* only = argc > 1 ? argv[1] : NULL;
+    size_t n = argc > 2 ? (size_t)strtoull(argv[2], NULL, 10) : 0;
+
+    if (!only || !strcmp(only, "latency")) {
+        printf("Tracking latency, %zu live pointers, MEMDEBUG_REHASH_STEP=%d:\n", n ? n : 4000000, MEMDEBUG_REHASH_STEP);
+        bench_tracking_latency(n ? n : 4000000);
+    }
+#if !MEMDEBUG_LOCKFREE
+    if (!only || !strcmp(only, "hash"))
+        bench_hash_policies(n ? n : 1000000);
+#endif
+    if (!only || !strcmp(only, "print_heap"))
+        bench_print_heap(n ? n : 10000000);
+    if (!only || !strcmp(only, "scan"))
+        bench_scan_threads(n ? n : 10000000);
+    if (!only || !strcmp(only, "dump_latency"))
+        bench_dump_latency(n ? n : 1000000);
+    if (!only || !strcmp(only, "fork"))
+        bench_fork_dump(n ? n : 10000000);
+    if (!only || !strcmp(only, "trace"))
+        bench_trace(n ? n : 1000000);
+}
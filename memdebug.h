@@ -1,5 +1,12 @@
 
 
+// Under -std=c99 or -std=c11, glibc hides clock_gettime(), MAP_ANONYMOUS and the like unless
+// they're asked for. That only works before the first system header is included, so a program
+// that includes others first and builds in a strict mode needs -D_DEFAULT_SOURCE.
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 /***********/
 /* Mutexes */
 /***********/
@@ -11,6 +18,7 @@
 #ifdef _WIN32
 // Use windows.h if compiling for Windows
 #include <Windows.h>
+#include <stdint.h>
 
 #define mutex_t SRWLOCK
 #define MUTEX_INITIALIZER SRWLOCK_INIT
@@ -22,22 +30,93 @@ static inline int mutex_lock(mutex_t* mutex) {
     AcquireSRWLockExclusive(mutex);
     return 0;
 }
+static inline int mutex_trylock(mutex_t* mutex) { return TryAcquireSRWLockExclusive(mutex) ? 0 : 1; }
 static inline int mutex_unlock(mutex_t* mutex) {
     ReleaseSRWLockExclusive(mutex);
     return 0;
 }
 static inline int mutex_destroy(mutex_t* mutex) { return 0; }
 
+#define once_t INIT_ONCE
+#define ONCE_INITIALIZER INIT_ONCE_STATIC_INIT
+static BOOL CALLBACK once_callback(PINIT_ONCE once, PVOID fn, PVOID* ctx) {
+    ((void (*)(void))fn)();
+    return TRUE;
+}
+static inline int once_run(once_t* once, void (*fn)(void)) {
+    return InitOnceExecuteOnce(once, once_callback, (PVOID)fn, NULL) ? 0 : 1;
+}
+
+// The destructor runs when a thread exits with a non-NULL value set for the key.
+#define tls_key_t DWORD
+static inline int tls_key_create(tls_key_t* key, void (*destructor)(void*)) {
+    *key = FlsAlloc((PFLS_CALLBACK_FUNCTION)destructor);
+    return *key == FLS_OUT_OF_INDEXES;
+}
+static inline int tls_set(tls_key_t key, void* value) { return FlsSetValue(key, value) ? 0 : 1; }
+
+// Thread functions are declared with THREAD_FN(name, arg), and return 0.
+#define thread_t HANDLE
+#define THREAD_FN(name, arg) DWORD WINAPI name(LPVOID arg)
+static inline int thread_create(thread_t* thread, LPTHREAD_START_ROUTINE fn, void* arg) {
+    *thread = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    return *thread ? 0 : 1;
+}
+static inline int thread_join(thread_t thread) {
+    WaitForSingleObject(thread, INFINITE);
+    return CloseHandle(thread) ? 0 : 1;
+}
+static inline int thread_detach(thread_t thread) { return CloseHandle(thread) ? 0 : 1; }
+static inline void thread_sleep_ms(unsigned ms) { Sleep(ms); }
+
+// A monotonic clock in nanoseconds.
+static inline uint64_t clock_ns() {
+    LARGE_INTEGER now, freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000 + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000 / (uint64_t)freq.QuadPart;
+}
+
 #else
 // On other platforms use <pthread.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
 #define mutex_t pthread_mutex_t
 #define MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
 static inline int mutex_init(mutex_t* mutex) { return pthread_mutex_init(mutex, NULL); }
 static inline int mutex_lock(mutex_t* mutex) { return pthread_mutex_lock(mutex); }
+static inline int mutex_trylock(mutex_t* mutex) { return pthread_mutex_trylock(mutex); }
 static inline int mutex_unlock(mutex_t* mutex) { return pthread_mutex_unlock(mutex); }
 static inline int mutex_destroy(mutex_t* mutex) { return pthread_mutex_destroy(mutex); }
+
+#define once_t pthread_once_t
+#define ONCE_INITIALIZER PTHREAD_ONCE_INIT
+static inline int once_run(once_t* once, void (*fn)(void)) { return pthread_once(once, fn); }
+
+// The destructor runs when a thread exits with a non-NULL value set for the key.
+#define tls_key_t pthread_key_t
+static inline int tls_key_create(tls_key_t* key, void (*destructor)(void*)) { return pthread_key_create(key, destructor); }
+static inline int tls_set(tls_key_t key, void* value) { return pthread_setspecific(key, value); }
+
+// Thread functions are declared with THREAD_FN(name, arg), and return 0.
+#define thread_t pthread_t
+#define THREAD_FN(name, arg) void* name(void* arg)
+static inline int thread_create(thread_t* thread, void* (*fn)(void*), void* arg) { return pthread_create(thread, NULL, fn, arg); }
+static inline int thread_join(thread_t thread) { return pthread_join(thread, NULL); }
+static inline int thread_detach(thread_t thread) { return pthread_detach(thread); }
+static inline void thread_sleep_ms(unsigned ms) {
+    struct timespec ts = {(time_t)(ms / 1000), (long)(ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+// A monotonic clock in nanoseconds.
+static inline uint64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
 #endif
 #endif  // End mutex include guard
 
@@ -97,191 +176,3218 @@ static inline int mutex_destroy(mutex_t* mutex) { return pthread_mutex_destroy(m
 #ifndef PRINT_MEMALLOCS
 #define PRINT_MEMALLOCS 1
 #endif
+
+// MEMDEBUG_TRACE compiles in memdebug_trace_start(), which records every allocation to a binary file.
+#ifndef MEMDEBUG_TRACE
+#define MEMDEBUG_TRACE 1
+#endif
 #endif
 
+// What print_heap_top() ranks call sites by.
+enum MemdebugOrder {
+    MEMDEBUG_BY_BYTES,
+    MEMDEBUG_BY_COUNT,
+    MEMDEBUG_BY_AVERAGE_SIZE,
+};
+typedef enum MemdebugOrder MemdebugOrder;
+
+// A heap report being written by a child process. See print_heap_fork().
+struct MemdebugDump {
+    long pid;        // The child writing the report, or 0 once it has been waited for
+    int status;      // 0 while the child runs, 1 once the report is written, -1 if it failed
+    char path[256];  // Where the report goes
+};
+typedef struct MemdebugDump MemdebugDump;
+
+// A live allocation, as returned by memdebug_iter_next().
+struct MemdebugRecord {
+    void* ptr;
+    size_t size;
+    const char* file;  // Where it was allocated
+    const char* func;
+    size_t line;
+};
+typedef struct MemdebugRecord MemdebugRecord;
+
+// A cursor over every live allocation. See memdebug_iter_begin(). The fields are memdebug's own.
+struct MemdebugIter {
+    size_t cursor[2];             // Where the next group of records is
+    size_t count;                 // Records read from the current group
+    size_t next;                  // The next of them to return
+    MemdebugRecord records[16];  // The current group
+};
+typedef struct MemdebugIter MemdebugIter;
+
 #if MEMDEBUG
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 void low_mem_print_heap();
 void print_heap();
+void print_heap_exact();
+void print_heap_top(size_t k, MemdebugOrder order_by);
+void set_heap_scan_threads(size_t num_threads);
+int print_heap_fork(const char* path, MemdebugDump* dump);
+int heap_dump_poll(MemdebugDump* dump);
+int heap_dump_wait(MemdebugDump* dump);
+void memdebug_iter_begin(MemdebugIter* it);
+bool memdebug_iter_next(MemdebugIter* it, MemdebugRecord* record);
+void memdebug_iter_end(MemdebugIter* it);
+int memdebug_trace_start(const char* path);
+void memdebug_trace_stop();
+
+/******************************************/
+/* Void Pointer Hash Function For Hashmap */
+/******************************************/
+
+/*
+ * Note that, by all accounts, this is a bad idea.
+ * How ptr_hash behaves is entirely implementation specific because how uintptr_t is implementation specific.
+ * However, it behaves in the sane way that you'd expect across most popular compilers.
+ *
+ * The tables are all powers of two and take the low 7 bits of the hash for the control byte,
+ * the bits above for the shard, and the rest for the probe start. So every policy has to leave
+ * its best mixed bits at the bottom. MEMDEBUG_HASH_POLICY picks one:
+ *   MEMDEBUG_HASH_FIBONACCI: Multiply by 2^64 / phi, then rotate the well mixed high half down.
+ *   MEMDEBUG_HASH_MURMUR:    MurmurHash3's finalizer. The best spread, and the most work.
+ *   MEMDEBUG_HASH_SHIFT:     The address shifted past malloc()'s alignment. Neighbouring allocations
+ *                            land in neighbouring slots, which is fast, but strided addresses cluster.
+ *   MEMDEBUG_HASH_XORSHIFT:  The address shifted and xored with itself, as memdebug always did.
+ */
+#define MEMDEBUG_HASH_FIBONACCI 1
+#define MEMDEBUG_HASH_MURMUR 2
+#define MEMDEBUG_HASH_SHIFT 3
+#define MEMDEBUG_HASH_XORSHIFT 4
+#ifndef MEMDEBUG_HASH_POLICY
+#define MEMDEBUG_HASH_POLICY MEMDEBUG_HASH_XORSHIFT
+#endif
+
+// log2 of malloc()'s minimum alignment, which is twice the size of a pointer on common platforms.
+#ifndef MEMDEBUG_ALIGN_SHIFT
+#define MEMDEBUG_ALIGN_SHIFT (UINTPTR_MAX > 0xFFFFFFFF ? 4 : 3)
+#endif
+
+#define MEMDEBUG_HASH_BITS (sizeof(size_t) * 8)
+
+static inline size_t
+ptr_hash_fibonacci(void* val) {
+#if SIZE_MAX > 0xFFFFFFFF
+    size_t product = (size_t)(uintptr_t)val * (size_t)0x9E3779B97F4A7C15ULL;
+#else
+    size_t product = (size_t)(uintptr_t)val * (size_t)0x9E3779B9UL;
+#endif
+    return (product >> (MEMDEBUG_HASH_BITS / 2)) | (product << (MEMDEBUG_HASH_BITS / 2));
+}
+
+static inline size_t
+ptr_hash_murmur(void* val) {
+    size_t h = (size_t)(uintptr_t)val;
+#if SIZE_MAX > 0xFFFFFFFF
+    h ^= h >> 33;
+    h *= (size_t)0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= (size_t)0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+#else
+    h ^= h >> 16;
+    h *= (size_t)0x85EBCA6BUL;
+    h ^= h >> 13;
+    h *= (size_t)0xC2B2AE35UL;
+    h ^= h >> 16;
+#endif
+    return h;
+}
+
+static inline size_t
+ptr_hash_shift(void* val) {
+    return (size_t)((uintptr_t)val >> MEMDEBUG_ALIGN_SHIFT);
+}
+
+static inline size_t
+ptr_hash_xorshift(void* val) {
+    size_t shifted = (size_t)((uintptr_t)val) >> (MEMDEBUG_ALIGN_SHIFT - 1);
+    size_t other = (size_t)((uintptr_t)val) << (9 - MEMDEBUG_ALIGN_SHIFT);
+    return shifted ^ other;
+}
+
+static inline size_t
+ptr_hash(void* val) {
+#if MEMDEBUG_HASH_POLICY == MEMDEBUG_HASH_FIBONACCI
+    return ptr_hash_fibonacci(val);
+#elif MEMDEBUG_HASH_POLICY == MEMDEBUG_HASH_MURMUR
+    return ptr_hash_murmur(val);
+#elif MEMDEBUG_HASH_POLICY == MEMDEBUG_HASH_SHIFT
+    return ptr_hash_shift(val);
+#else
+    return ptr_hash_xorshift(val);
+#endif
+}
+
+/*************************************************/
+/* Control Byte Groups For Open Addressing Probe */
+/*************************************************/
+
+/*
+ * The allocation table is an open addressing table in the style of a Swiss table.
+ * Every slot has a control byte. An empty slot is 0x00, a deleted slot is 0x01,
+ * and a full slot is 0x80 with the low 7 bits of the pointer's hash.
+ * Slots are probed 16 at a time, one "group" of control bytes per probe step.
+ */
+#define MEMDEBUG_CTRL_EMPTY ((uint8_t)0x00)
+#define MEMDEBUG_CTRL_DELETED ((uint8_t)0x01)
+#define MEMDEBUG_CTRL_FULL ((uint8_t)0x80)
+#define MEMDEBUG_GROUP_WIDTH 16
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MEMDEBUG_SSE2 1
+#include <emmintrin.h>
+#else
+#define MEMDEBUG_SSE2 0
+#endif
+
+// Returns a bitmask with a bit set for every control byte in the group equal to ctrl.
+static inline uint32_t
+group_match(const uint8_t* group, uint8_t ctrl) {
+#if MEMDEBUG_SSE2
+    __m128i g = _mm_load_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)ctrl)));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < MEMDEBUG_GROUP_WIDTH; i++)
+        mask |= (uint32_t)(group[i] == ctrl) << i;
+    return mask;
+#endif
+}
+
+// Returns a bitmask with a bit set for every full slot in the group.
+static inline uint32_t
+group_match_full(const uint8_t* group) {
+#if MEMDEBUG_SSE2
+    return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i*)group));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < MEMDEBUG_GROUP_WIDTH; i++)
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    return mask;
+#endif
+}
+
+static inline uint32_t
+group_match_empty_or_deleted(const uint8_t* group) {
+    return ~group_match_full(group) & 0xFFFF;
+}
+
+static inline unsigned
+bit_ctz(uint32_t mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long idx;
+    _BitScanForward(&idx, mask);
+    return (unsigned)idx;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+
+static inline unsigned
+bit_ctz64(uint64_t mask) {
+#if defined(_MSC_VER) && !defined(__clang__) && defined(_WIN64)
+    unsigned long idx;
+    _BitScanForward64(&idx, mask);
+    return (unsigned)idx;
+#elif defined(_MSC_VER) && !defined(__clang__)
+    return (uint32_t)mask ? bit_ctz((uint32_t)mask) : 32 + bit_ctz((uint32_t)(mask >> 32));
+#else
+    return (unsigned)__builtin_ctzll(mask);
+#endif
+}
+
+// Occupancy bitmaps keep one bit per group of slots, set while the group might hold a live
+// allocation, so that heap scans can skip over empty stretches of a table 64 groups at a time.
+static inline size_t
+occupancy_words(size_t capacity) {
+    return (capacity / MEMDEBUG_GROUP_WIDTH + 63) / 64;
+}
+
+// Where the part-th of parts slices of a table starts, in whole bitmap words, so scans can be split up.
+static inline size_t
+scan_slice(size_t capacity, size_t part, size_t parts) {
+    size_t start = occupancy_words(capacity) * part / parts * 64 * MEMDEBUG_GROUP_WIDTH;
+    return start < capacity ? start : capacity;
+}
+
+#ifndef MEMDEBUG_CACHE_LINE
+#define MEMDEBUG_CACHE_LINE 64
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define MEMDEBUG_ALIGNED(n) __declspec(align(n))
+#else
+#define MEMDEBUG_ALIGNED(n) __attribute__((aligned(n)))
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define MEMDEBUG_THREAD_LOCAL __declspec(thread)
+#else
+#define MEMDEBUG_THREAD_LOCAL __thread
+#endif
+
+// Declares fn and has it run before main(), ahead of ordinary constructors, where the compiler allows.
+#if defined(__GNUC__) || defined(__clang__)
+#define MEMDEBUG_HAVE_CONSTRUCTOR 1
+#define MEMDEBUG_CONSTRUCTOR(fn) static void fn(void) __attribute__((constructor(101)));
+#elif defined(_MSC_VER)
+#define MEMDEBUG_HAVE_CONSTRUCTOR 1
+#pragma section(".CRT$XCT", read)
+#define MEMDEBUG_CONSTRUCTOR(fn) \
+    static void fn(void);        \
+    __declspec(allocate(".CRT$XCT")) void (*fn##_at_startup)(void) = fn;
+#else
+#define MEMDEBUG_HAVE_CONSTRUCTOR 0
+#define MEMDEBUG_CONSTRUCTOR(fn)
+#endif
+
+/******************/
+/* Tracker Memory */
+/******************/
+
+/*
+ * memdebug's own bookkeeping never comes from malloc(), so it doesn't show up in (or
+ * fragment) the heap being measured. Tables and other big buffers are mapped straight from
+ * the OS. Small fixed-size records come from slabs: chunks of MEMDEBUG_SLAB_CHUNK bytes cut
+ * into equal nodes, with freed nodes kept on an intrusive free list. Everything mapped is
+ * counted in tracker_bytes, which the heap dumps report separately.
+ */
+#ifndef MEMDEBUG_SLAB_CHUNK
+#define MEMDEBUG_SLAB_CHUNK 65536
+#endif
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+static mutex_t tracker_mutex = MUTEX_INITIALIZER;
+static size_t tracker_bytes = 0;  // Guarded by tracker_mutex
+
+// Returns zeroed memory, or NULL.
+static inline void*
+os_pages_map(size_t size) {
+#ifdef _WIN32
+    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    // Only reserve address space. Pages are committed, zeroed by the kernel, the first time they're touched.
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    void* pages = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return pages == MAP_FAILED ? NULL : pages;
+#endif
+}
+
+static inline void
+os_pages_unmap(void* pages, size_t size) {
+#ifdef _WIN32
+    VirtualFree(pages, 0, MEM_RELEASE);
+#else
+    munmap(pages, size);
+#endif
+}
+
+/*
+ * MEMDEBUG_OOM_RESERVE bytes are mapped and touched at startup, so they're really there
+ * when nothing else is. While the OS refuses memdebug more pages, its tables and slabs are
+ * carved out of the reserve instead, and only once that runs out is it an OOM. OOM() and
+ * mempanic() hand what's left back to the OS first, so that printf() has room for its
+ * buffers while the report is written. Set it to 0 to go without. The reserve isn't part of
+ * tracker_bytes until it's used. Pages freed back to it can only be used again if they were the
+ * last ones carved out, so any others stay in tracker_bytes.
+ */
+#ifndef MEMDEBUG_OOM_RESERVE
+#define MEMDEBUG_OOM_RESERVE (1024 * 1024)
+#endif
+#define MEMDEBUG_PAGE_SIZE 4096
+
+static char* oom_reserve = NULL;       // Guarded by tracker_mutex, like the rest
+static char* oom_reserve_next = NULL;  // The unused part, page aligned
+static char* oom_reserve_end = NULL;
+#if !MEMDEBUG_HAVE_CONSTRUCTOR
+static once_t oom_reserve_once = ONCE_INITIALIZER;
+#endif
+
+MEMDEBUG_CONSTRUCTOR(oom_reserve_init)
+static void
+oom_reserve_init(void) {
+#if MEMDEBUG_OOM_RESERVE
+    char* pages = (char*)os_pages_map(MEMDEBUG_OOM_RESERVE);
+    if (!pages)
+        return;
+    for (size_t i = 0; i < MEMDEBUG_OOM_RESERVE; i += MEMDEBUG_PAGE_SIZE)
+        ((volatile char*)pages)[i] = 0;
+
+    mutex_lock(&tracker_mutex);
+    oom_reserve = oom_reserve_next = pages;
+    oom_reserve_end = pages + MEMDEBUG_OOM_RESERVE;
+    mutex_unlock(&tracker_mutex);
+#endif
+}
+
+static inline void
+oom_reserve_ready() {
+#if !MEMDEBUG_HAVE_CONSTRUCTOR
+    once_run(&oom_reserve_once, oom_reserve_init);
+#endif
+}
+
+// Zeroed pages from the reserve, or NULL. Needs tracker_mutex.
+static inline void*
+oom_reserve_take(size_t size) {
+    size = (size + MEMDEBUG_PAGE_SIZE - 1) / MEMDEBUG_PAGE_SIZE * MEMDEBUG_PAGE_SIZE;
+    if (!oom_reserve_next || (size_t)(oom_reserve_end - oom_reserve_next) < size)
+        return NULL;
+    void* pages = oom_reserve_next;
+    oom_reserve_next += size;
+    return pages;
+}
+
+static inline bool
+oom_reserve_owns(void* pages) {
+    return oom_reserve && (char*)pages >= oom_reserve && (char*)pages < oom_reserve_end;
+}
+
+// Give back pages from oom_reserve_take(), if they were the last taken. Needs tracker_mutex.
+// Returns whether they were.
+static inline bool
+oom_reserve_put(void* pages, size_t size) {
+    size = (size + MEMDEBUG_PAGE_SIZE - 1) / MEMDEBUG_PAGE_SIZE * MEMDEBUG_PAGE_SIZE;
+    if ((char*)pages + size != oom_reserve_next)
+        return false;
+    memset(pages, 0, size);
+    oom_reserve_next = (char*)pages;
+    return true;
+}
+
+// Give the unused part of the reserve back to the OS, for the allocations an error report makes.
+static inline void
+oom_reserve_release() {
+    mutex_lock(&tracker_mutex);
+    if (oom_reserve_next && oom_reserve_next < oom_reserve_end) {
+#ifdef _WIN32
+        VirtualFree(oom_reserve_next, (size_t)(oom_reserve_end - oom_reserve_next), MEM_DECOMMIT);
+#else
+        munmap(oom_reserve_next, (size_t)(oom_reserve_end - oom_reserve_next));
+#endif
+    }
+    oom_reserve_end = oom_reserve_next;
+    mutex_unlock(&tracker_mutex);
+}
+
+// Returns zeroed memory, or NULL.
+static inline void*
+tracker_pages_alloc(size_t size) {
+    oom_reserve_ready();
+    void* pages = os_pages_map(size);
+    mutex_lock(&tracker_mutex);
+    if (!pages)
+        pages = oom_reserve_take(size);
+    if (pages)
+        tracker_bytes += size;
+    mutex_unlock(&tracker_mutex);
+    return pages;
+}
+
+static inline void
+tracker_pages_free(void* pages, size_t size) {
+    if (!pages)
+        return;
+    mutex_lock(&tracker_mutex);
+    bool reserved = oom_reserve_owns(pages);
+    // Reserve pages that can't be given back are still memdebug's.
+    if (!reserved || oom_reserve_put(pages, size))
+        tracker_bytes -= size;
+    mutex_unlock(&tracker_mutex);
+    if (!reserved)
+        os_pages_unmap(pages, size);
+}
+
+struct TrackerSlab;
+typedef struct TrackerSlab TrackerSlab;
+struct TrackerSlab {
+    size_t node_size;  // A multiple of the cache line, so nodes can hold cache line aligned structs
+    void* free_list;   // Each free node starts with a pointer to the next one
+    char* next;        // The rest of the current chunk
+    char* end;
+};
+
+#define TRACKER_SLAB_INITIALIZER(type) \
+    { ((sizeof(type) + MEMDEBUG_CACHE_LINE - 1) / MEMDEBUG_CACHE_LINE) * MEMDEBUG_CACHE_LINE, NULL, NULL, NULL }
+
+// Returns a zeroed node, or NULL.
+static inline void*
+slab_alloc(TrackerSlab* slab) {
+    oom_reserve_ready();
+    mutex_lock(&tracker_mutex);
+    void* node = slab->free_list;
+    if (node) {
+        slab->free_list = *(void**)node;
+    } else {
+        if (!slab->next || slab->next + slab->node_size > slab->end) {
+            size_t chunk = slab->node_size > MEMDEBUG_SLAB_CHUNK ? slab->node_size : MEMDEBUG_SLAB_CHUNK;
+            char* pages = (char*)os_pages_map(chunk);
+            if (!pages)
+                pages = (char*)oom_reserve_take(chunk);
+            if (!pages) {
+                mutex_unlock(&tracker_mutex);
+                return NULL;
+            }
+            // The rest of the old chunk is abandoned, but it's less than a node.
+            tracker_bytes += chunk;
+            slab->next = pages;
+            slab->end = pages + chunk;
+        }
+        node = slab->next;
+        slab->next += slab->node_size;
+    }
+    mutex_unlock(&tracker_mutex);
+
+    memset(node, 0, slab->node_size);
+    return node;
+}
+
+static inline void
+slab_free(TrackerSlab* slab, void* node) {
+    mutex_lock(&tracker_mutex);
+    *(void**)node = slab->free_list;
+    slab->free_list = node;
+    mutex_unlock(&tracker_mutex);
+}
+
+static inline size_t
+tracker_memory() {
+    mutex_lock(&tracker_mutex);
+    size_t bytes = tracker_bytes;
+    mutex_unlock(&tracker_mutex);
+    return bytes;
+}
+
+// For the out of memory report, which can't wait on a lock the thread that ran out may be holding.
+// If the lock is taken the count is read anyway, and may be a little off.
+static inline size_t
+tracker_memory_nowait() {
+    if (mutex_trylock(&tracker_mutex))
+        return tracker_bytes;
+    size_t bytes = tracker_bytes;
+    mutex_unlock(&tracker_mutex);
+    return bytes;
+}
+
+static inline void OOM(size_t line, const char* func, const char* file, size_t num_bytes);
+
+/**************/
+/* Call Sites */
+/**************/
+
+/*
+ * Every malloc(), realloc() and free() in the program has a CallSite descriptor, and
+ * allocation records keep its 32 bit id instead of the file, function and line.
+ *
+ * With GNU C, each macro expansion defines its own static descriptor and passes a pointer to
+ * it, and a pointer to every descriptor is also put in the memdebug_sites section. On ELF
+ * targets the linker gathers that section into one array, so every instrumented site is
+ * registered before main(), including ones that never run. Elsewhere a site is registered
+ * the first time it's used. Without GNU C, descriptors are interned by (file, function, line)
+ * instead, behind a small per-thread cache so the lock is only taken the first time a thread
+ * allocates from a site.
+ *
+ * The id of a site is stored in its descriptor plus one, so that zero means unregistered. The
+ * table from ids back to descriptors is kept in chunks that never move, so it can be read
+ * without taking the lock.
+ *
+ * Each site also counts its live and cumulative allocations and bytes. They're updated with
+ * relaxed atomics as the allocations happen, so a heap summary only has to read the sites.
+ */
+#ifndef MEMDEBUG_SITE_CACHE
+#define MEMDEBUG_SITE_CACHE 64  // Must be a power of 2
+#endif
+#define SITE_CHUNK 1024
+#define SITE_MAX_CHUNKS 1024
+
+#if defined(__GNUC__) || defined(__clang__)
+#define site_id_load(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define site_id_store(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define site_counter_add(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#define site_counter_load(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#else
+#define site_id_load(p) (*(volatile uint32_t*)(p))
+#define site_id_store(p, v) (*(volatile uint32_t*)(p) = (v))
+#ifdef _WIN64
+#define site_counter_add(p, v) InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v))
+#else
+#define site_counter_add(p, v) InterlockedExchangeAdd((volatile LONG*)(p), (LONG)(v))
+#endif
+#define site_counter_load(p) (*(volatile size_t*)(p))
+#endif
+
+#ifndef MEMDEBUG_STATIC_SITES
+#if defined(__GNUC__) || defined(__clang__)
+#define MEMDEBUG_STATIC_SITES 1
+#else
+#define MEMDEBUG_STATIC_SITES 0
+#endif
+#endif
+
+#if MEMDEBUG_STATIC_SITES && defined(__ELF__)
+#define MEMDEBUG_SITE_SECTION 1
+#else
+#define MEMDEBUG_SITE_SECTION 0
+#endif
+
+struct CallSite;
+typedef struct CallSite CallSite;
+struct CallSite {
+    const char* file;
+    const char* func;
+    size_t line;
+    uint32_t id;  // The id plus one, or zero before the site is registered
+
+    // Updated with site_counter_add()
+    size_t live_count;
+    size_t live_bytes;
+    size_t total_count;
+    size_t total_bytes;
+};
+
+static CallSite** site_chunks[SITE_MAX_CHUNKS];  // Written under site_mutex before any id in them is handed out
+static size_t site_count = 0;                    // Guarded by site_mutex
+static mutex_t site_mutex = MUTEX_INITIALIZER;
+
+static inline CallSite*
+site_get(uint32_t id) {
+    return site_chunks[id / SITE_CHUNK][id % SITE_CHUNK];
+}
+
+static uint32_t
+site_register(CallSite* site) {
+    mutex_lock(&site_mutex);
+    uint32_t id = site->id;
+    if (!id) {
+        if (site_count == (size_t)SITE_CHUNK * SITE_MAX_CHUNKS) OOM(site->line, site->func, site->file, sizeof(CallSite*));
+        if (site_count % SITE_CHUNK == 0) {
+            site_chunks[site_count / SITE_CHUNK] = (CallSite**)tracker_pages_alloc(sizeof(CallSite*) * SITE_CHUNK);
+            if (!site_chunks[site_count / SITE_CHUNK]) OOM(__LINE__ - 1, __func__, __FILE__, sizeof(CallSite*) * SITE_CHUNK);
+        }
+        site_chunks[site_count / SITE_CHUNK][site_count % SITE_CHUNK] = site;
+        id = (uint32_t)++site_count;
+        site_id_store(&site->id, id);
+    }
+    mutex_unlock(&site_mutex);
+    return id - 1;
+}
+
+static inline uint32_t
+site_id(CallSite* site) {
+    uint32_t id = site_id_load(&site->id);
+    return id ? id - 1 : site_register(site);
+}
+
+static inline void
+site_count_alloc(CallSite* site, size_t size) {
+    site_counter_add(&site->live_count, 1);
+    site_counter_add(&site->live_bytes, size);
+    site_counter_add(&site->total_count, 1);
+    site_counter_add(&site->total_bytes, size);
+}
+
+static inline void
+site_count_free(uint32_t id, size_t size) {
+    CallSite* site = site_get(id);
+    site_counter_add(&site->live_count, (size_t)-1);
+    site_counter_add(&site->live_bytes, (size_t)0 - size);
+}
+
+static inline size_t
+site_num() {
+    mutex_lock(&site_mutex);
+    size_t count = site_count;
+    mutex_unlock(&site_mutex);
+    return count;
+}
+
+// site_num() for the out of memory report. Every site below the count is registered either way.
+static inline size_t
+site_num_nowait() {
+    if (mutex_trylock(&site_mutex))
+        return site_count;
+    size_t count = site_count;
+    mutex_unlock(&site_mutex);
+    return count;
+}
+
+static inline bool
+compare_sites(const CallSite* s1, const CallSite* s2) {
+    // First by file, then by line
+    int cmp = strcmp(s1->file, s2->file);
+    return cmp ? cmp > 0 : s1->line > s2->line;
+}
+
+static inline void
+sort_sites(CallSite** sites, size_t n) {
+    // There are only as many of these as there are malloc() calls in the source. This is a shellsort.
+    for (size_t interval = n / 2; interval > 0; interval /= 2) {
+        for (size_t i = interval; i < n; i++) {
+            CallSite* temp = sites[i];
+            size_t j;
+            for (j = i; j >= interval && compare_sites(sites[j - interval], temp); j -= interval)
+                sites[j] = sites[j - interval];
+            sites[j] = temp;
+        }
+    }
+}
+
+// The first n sites in file and line order.
+// The caller frees it with tracker_pages_free(sites, sizeof(CallSite*) * n).
+static inline CallSite**
+site_order(size_t n) {
+    if (!n)
+        return NULL;
+    CallSite** sites = (CallSite**)tracker_pages_alloc(sizeof(CallSite*) * n);
+    if (!sites) OOM(__LINE__ - 1, __func__, __FILE__, sizeof(CallSite*) * n);
+
+    for (size_t id = 0; id < n; id++)
+        sites[id] = site_get((uint32_t)id);
+    sort_sites(sites, n);
+    return sites;
+}
+
+#if MEMDEBUG_STATIC_SITES
+#if MEMDEBUG_SITE_SECTION
+#define MEMDEBUG_SITE_ENTRY __attribute__((section("memdebug_sites"), used))
+
+// Defined by the linker, as long as any descriptor made it into the section.
+extern CallSite* const __start_memdebug_sites[] __attribute__((weak));
+extern CallSite* const __stop_memdebug_sites[] __attribute__((weak));
+
+// Register the sites by file and line, so that heap reports list them in that order.
+MEMDEBUG_CONSTRUCTOR(sites_init)
+static void
+sites_init(void) {
+    if (!__start_memdebug_sites)
+        return;
+    size_t n = (size_t)(__stop_memdebug_sites - __start_memdebug_sites);
+    CallSite** sites = (CallSite**)tracker_pages_alloc(sizeof(CallSite*) * n);
+    if (!sites) OOM(__LINE__ - 1, __func__, __FILE__, sizeof(CallSite*) * n);
+    memcpy(sites, __start_memdebug_sites, sizeof(CallSite*) * n);
+    sort_sites(sites, n);
+
+    for (size_t i = 0; i < n; i++)
+        site_id(sites[i]);
+    tracker_pages_free(sites, sizeof(CallSite*) * n);
+}
+#else
+#define MEMDEBUG_SITE_ENTRY __attribute__((unused))
+#endif
+
+// The descriptor for the call site this is expanded at.
+#define MEMDEBUG_CALL_SITE() (__extension__({                                          \
+    static CallSite memdebug_call_site = {__FILE__, __func__, __LINE__, 0, 0, 0, 0, 0}; \
+    static CallSite* const memdebug_call_site_entry MEMDEBUG_SITE_ENTRY = &memdebug_call_site; \
+    &memdebug_call_site;                                                               \
+}))
+#else
+struct SiteCacheEntry;
+typedef struct SiteCacheEntry SiteCacheEntry;
+struct SiteCacheEntry {
+    const char* file;
+    const char* func;
+    size_t line;
+    CallSite* site;
+};
+
+static CallSite** site_index = NULL;  // Open addressed, guarded by site_mutex
+static size_t site_index_capacity = 0;
+static size_t site_index_count = 0;
+static TrackerSlab site_slab = TRACKER_SLAB_INITIALIZER(CallSite);
+static MEMDEBUG_THREAD_LOCAL SiteCacheEntry site_cache[MEMDEBUG_SITE_CACHE];
+
+static inline size_t
+site_hash(size_t line, const char* func, const char* file) {
+    size_t h = (size_t)(uintptr_t)file * 31 + (size_t)(uintptr_t)func;
+    return ptr_hash_murmur((void*)(uintptr_t)(h * 31 + line));
+}
+
+// Find the slot in site_index holding the site, or the empty slot where it belongs.
+static inline size_t
+site_index_find(size_t hash, size_t line, const char* func, const char* file) {
+    size_t mask = site_index_capacity - 1;
+    for (size_t idx = hash & mask;; idx = (idx + 1) & mask) {
+        CallSite* site = site_index[idx];
+        if (!site || (site->line == line && site->func == func && site->file == file))
+            return idx;
+    }
+}
+
+static inline void
+site_index_grow() {
+    size_t old_capacity = site_index_capacity;
+    CallSite** old = site_index;
+    site_index_capacity = old_capacity ? old_capacity * 2 : 1024;
+    site_index = (CallSite**)tracker_pages_alloc(sizeof(CallSite*) * site_index_capacity);
+    if (!site_index) OOM(__LINE__ - 1, __func__, __FILE__, sizeof(CallSite*) * site_index_capacity);
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        CallSite* site = old[i];
+        if (site)
+            site_index[site_index_find(site_hash(site->line, site->func, site->file), site->line, site->func, site->file)] = site;
+    }
+    tracker_pages_free(old, sizeof(CallSite*) * old_capacity);
+}
+
+static inline CallSite*
+site_intern(size_t line, const char* func, const char* file) {
+    size_t hash = site_hash(line, func, file);
+    SiteCacheEntry* cached = &site_cache[hash & (MEMDEBUG_SITE_CACHE - 1)];
+    if (cached->line == line && cached->func == func && cached->file == file)
+        return cached->site;
+
+    mutex_lock(&site_mutex);
+    if ((site_index_count + 1) * 2 > site_index_capacity)
+        site_index_grow();
+    size_t idx = site_index_find(hash, line, func, file);
+    if (!site_index[idx]) {
+        CallSite* site = (CallSite*)slab_alloc(&site_slab);
+        if (!site) OOM(line, func, file, sizeof(CallSite));
+        site->file = file;
+        site->func = func;
+        site->line = line;
+        site_index[idx] = site;
+        site_index_count++;
+    }
+    CallSite* site = site_index[idx];
+    mutex_unlock(&site_mutex);
+
+    cached->file = file;
+    cached->func = func;
+    cached->line = line;
+    cached->site = site;
+    return site;
+}
+
+#define MEMDEBUG_CALL_SITE() site_intern(__LINE__, __func__, __FILE__)
+#endif
+
+/**************************************/
+/* Global Allocation Tracking Hashmap */
+/**************************************/
+
+/*
+ * A record is a pointer, its size, and its call site, in 16 bytes. Where user space pointers
+ * fit in 48 bits, the pointer shares a word with the high bits of the size. That's the default
+ * on x86-64 only: on ARM64, allocators may tag the top byte of the pointers they return (top
+ * byte ignore, MTE, HWASan), and a tagged pointer doesn't fit.
+ */
+#ifndef MEMDEBUG_PACK_POINTERS
+#if defined(__x86_64__) || defined(_M_X64)
+#define MEMDEBUG_PACK_POINTERS 1
+#else
+#define MEMDEBUG_PACK_POINTERS 0
+#endif
+#endif
+
+struct MemAlloc;
+typedef struct MemAlloc MemAlloc;
+struct MemAlloc {
+#if MEMDEBUG_PACK_POINTERS
+    uint64_t ptr_and_size_hi;  // The pointer in the low 48 bits, bits 32 to 47 of the size in the high 16
+    uint32_t size_lo;
+#else
+    void* ptr;
+    size_t size;
+#endif
+    uint32_t site;
+};
+
+static inline MemAlloc
+memalloc_make(void* ptr, size_t size, uint32_t site) {
+    MemAlloc alloc;
+#if MEMDEBUG_PACK_POINTERS
+    alloc.ptr_and_size_hi = (uint64_t)(uintptr_t)ptr | ((uint64_t)size >> 32 << 48);
+    alloc.size_lo = (uint32_t)size;
+#else
+    alloc.ptr = ptr;
+    alloc.size = size;
+#endif
+    alloc.site = site;
+    return alloc;
+}
+
+static inline void*
+memalloc_ptr(const MemAlloc* alloc) {
+#if MEMDEBUG_PACK_POINTERS
+    return (void*)(uintptr_t)(alloc->ptr_and_size_hi & 0xFFFFFFFFFFFFULL);
+#else
+    return alloc->ptr;
+#endif
+}
+
+static inline size_t
+memalloc_size(const MemAlloc* alloc) {
+#if MEMDEBUG_PACK_POINTERS
+    return (size_t)(alloc->ptr_and_size_hi >> 48 << 32) | alloc->size_lo;
+#else
+    return alloc->size;
+#endif
+}
+
+// Whether a pointer and size can be stored in a record.
+static inline bool
+memalloc_fits(void* ptr, size_t size) {
+#if MEMDEBUG_PACK_POINTERS
+    return !((uint64_t)(uintptr_t)ptr >> 48) && !((uint64_t)size >> 48);
+#else
+    (void)ptr;
+    (void)size;
+    return true;
+#endif
+}
+
+/*
+ * MEMDEBUG_LOCKFREE swaps the locked shards below for a lock-free registry. It needs C11 atomics.
+ */
+#ifndef MEMDEBUG_LOCKFREE
+#define MEMDEBUG_LOCKFREE 0
+#endif
+
+/*
+ * MEMDEBUG_MAX_LOAD_FACTOR is the percentage of slots (live plus deleted) that may be
+ * used before the table grows. MEMDEBUG_MAX_PROBE_LENGTH is the number of groups an
+ * insert may probe before the table grows regardless of its load.
+ *
+ * Growing does not rehash everything at once. Every alloc_add() and alloc_remove()
+ * migrates at most MEMDEBUG_REHASH_STEP slots of the old table into the new one, and
+ * lookups check both tables until the migration finishes. Set it to 0 to migrate the
+ * whole table as soon as it grows.
+ */
+#ifndef MEMDEBUG_MAX_LOAD_FACTOR
+#define MEMDEBUG_MAX_LOAD_FACTOR 87
+#endif
+#ifndef MEMDEBUG_MAX_PROBE_LENGTH
+#define MEMDEBUG_MAX_PROBE_LENGTH 16
+#endif
+#ifndef MEMDEBUG_MIN_CAPACITY
+#define MEMDEBUG_MIN_CAPACITY 1024
+#endif
+#ifndef MEMDEBUG_REHASH_STEP
+#define MEMDEBUG_REHASH_STEP 32
+#endif
+
+static inline size_t
+table_growth_limit(size_t capacity) {
+    return (capacity / 100) * MEMDEBUG_MAX_LOAD_FACTOR + ((capacity % 100) * MEMDEBUG_MAX_LOAD_FACTOR) / 100;
+}
+
+#if !MEMDEBUG_LOCKFREE
+struct TableSnapshot;
+typedef struct TableSnapshot TableSnapshot;
+
+struct AllocTable;
+typedef struct AllocTable AllocTable;
+struct AllocTable {
+    uint8_t* ctrl;       // capacity control bytes, aligned to the group width
+    MemAlloc* slots;     // capacity slots
+    uint64_t* occupied;  // One bit per group, set when the group has a full slot
+    size_t capacity;     // Zero, or a power of two and a multiple of the group width
+    size_t used;         // Full plus deleted slots
+    size_t growth_left;  // Inserts into empty slots before the table must grow
+    TableSnapshot* snap; // The heap snapshot this table is part of, or NULL
+};
+
+/*
+ * While a heap snapshot is being read, the tables it covers are copy on write, one group at
+ * a time. The first change to a group saves what it held when the snapshot was taken, and the
+ * snapshot reads saved groups from the copy and the rest from the table itself. A table the
+ * map is done with is handed to the snapshot to free, instead of being unmapped under it.
+ */
+struct TableSnapshot {
+    AllocTable table;  // The table when the snapshot was taken. Its pages stay mapped until the snapshot ends.
+    size_t start;      // Slots before this had already been migrated out
+    uint64_t* saved;   // One bit per group, set once the group has been copied below
+    uint8_t* ctrl;     // The saved groups' control bytes and slots, at the same indexes as in the table
+    MemAlloc* slots;
+    bool orphaned;     // The map has freed the table, so the snapshot owns its pages
+};
+
+struct AllocMap;
+typedef struct AllocMap AllocMap;
+struct AllocMap {
+    AllocTable table; // Receives every insert
+    AllocTable old;   // The table being migrated out of, or capacity 0
+    size_t migrated;  // Slots of old that have already been migrated
+};
+
+/*
+ * The allocation table is split into shards by pointer hash, each with its own mutex,
+ * so threads working on unrelated pointers never contend. MEMDEBUG_SHARDS sets the number
+ * of shards. When it is 0, MEMDEBUG_SHARDS_PER_CPU shards are made for every online core.
+ * Either way the count is rounded up to a power of two and capped at MEMDEBUG_MAX_SHARDS.
+ */
+#ifndef MEMDEBUG_SHARDS
+#define MEMDEBUG_SHARDS 0
+#endif
+#ifndef MEMDEBUG_SHARDS_PER_CPU
+#define MEMDEBUG_SHARDS_PER_CPU 4
+#endif
+#ifndef MEMDEBUG_MAX_SHARDS
+#define MEMDEBUG_MAX_SHARDS 256
+#endif
+// Padded out to a cache line so that neighbouring shards' locks don't share one.
+struct AllocShard;
+typedef struct AllocShard AllocShard;
+struct MEMDEBUG_ALIGNED(MEMDEBUG_CACHE_LINE) AllocShard {
+    mutex_t mutex; // Guards the rest of the shard
+    AllocMap map;
+    size_t num_allocs;
+    TableSnapshot snaps[2]; // Of map.table and map.old, while a heap snapshot is being read
+};
+
+// Global alloc hash table
+static AllocShard alloc_shards[MEMDEBUG_MAX_SHARDS];
+static size_t alloc_shard_count = 1;
+static size_t alloc_shard_bits = 0;
+#if !MEMDEBUG_HAVE_CONSTRUCTOR
+static once_t alloc_shards_once = ONCE_INITIALIZER;
+#endif
+
+static inline size_t
+num_cpus() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (size_t)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+#endif
+}
+
+// The shard count is fixed at startup where possible, so the allocation path never has to check it.
+MEMDEBUG_CONSTRUCTOR(alloc_shards_init)
+static void
+alloc_shards_init(void) {
+    size_t wanted = MEMDEBUG_SHARDS ? MEMDEBUG_SHARDS : MEMDEBUG_SHARDS_PER_CPU * num_cpus();
+    while (alloc_shard_count < wanted && alloc_shard_count < MEMDEBUG_MAX_SHARDS) {
+        alloc_shard_count *= 2;
+        alloc_shard_bits++;
+    }
+    for (size_t i = 0; i < alloc_shard_count; i++)
+        mutex_init(&alloc_shards[i].mutex);
+}
+
+static inline void
+alloc_shards_ready() {
+#if !MEMDEBUG_HAVE_CONSTRUCTOR
+    once_run(&alloc_shards_once, alloc_shards_init);
+#endif
+}
+
+// The shard is picked by the hash bits just above the control byte's.
+static inline AllocShard*
+alloc_shard(size_t hash) {
+    alloc_shards_ready();
+    return alloc_shards + ((hash >> 7) & (alloc_shard_count - 1));
+}
+
+// Drop the bits used to pick the shard, so the shard's table probes on bits that still vary.
+static inline size_t
+shard_hash(size_t hash) {
+    return (hash & 0x7F) | ((hash >> (7 + alloc_shard_bits)) << 7);
+}
+
+/***************/
+/* Map Methods */
+/***************/
+
+// Probe for an empty or deleted slot. The pointer must not already be in the table.
+static inline size_t
+table_find_insert_slot(AllocTable* table, size_t hash, size_t* probe_length) {
+    size_t group_mask = (table->capacity / MEMDEBUG_GROUP_WIDTH) - 1;
+    size_t group = (hash >> 7) & group_mask;
+    for (size_t step = 1;; step++) {
+        uint32_t mask = group_match_empty_or_deleted(table->ctrl + group * MEMDEBUG_GROUP_WIDTH);
+        if (mask) {
+            *probe_length = step;
+            return group * MEMDEBUG_GROUP_WIDTH + bit_ctz(mask);
+        }
+        // Triangular probing over groups visits every group when their count is a power of two.
+        group = (group + step) & group_mask;
+    }
+}
+
+// Returns the slot holding ptr, or the table's capacity if it isn't there.
+static inline size_t
+table_find(AllocTable* table, void* ptr, size_t hash) {
+    if (!table->capacity)
+        return 0;
+
+    uint8_t h2 = MEMDEBUG_CTRL_FULL | (uint8_t)(hash & 0x7F);
+    size_t group_mask = (table->capacity / MEMDEBUG_GROUP_WIDTH) - 1;
+    size_t group = (hash >> 7) & group_mask;
+
+    // Traverse the probe sequence looking for the pointer, stopping at the first group with an empty slot.
+    for (size_t step = 1; step <= group_mask + 1; step++) {
+        const uint8_t* ctrl = table->ctrl + group * MEMDEBUG_GROUP_WIDTH;
+        uint32_t match = group_match(ctrl, h2);
+        while (match) {
+            size_t idx = group * MEMDEBUG_GROUP_WIDTH + bit_ctz(match);
+            match &= match - 1;
+            if (memalloc_ptr(&table->slots[idx]) == ptr)
+                return idx;
+        }
+        if (group_match(ctrl, MEMDEBUG_CTRL_EMPTY))
+            break;
+        group = (group + step) & group_mask;
+    }
+
+    return table->capacity;
+}
+
+// Save the group holding slot idx for the table's snapshot, unless it already has been.
+static inline void
+table_snap_save(AllocTable* table, size_t idx) {
+    TableSnapshot* snap = table->snap;
+    size_t group = idx / MEMDEBUG_GROUP_WIDTH;
+    uint64_t bit = (uint64_t)1 << (group % 64);
+    if (snap->saved[group / 64] & bit)
+        return;
+    size_t first = group * MEMDEBUG_GROUP_WIDTH;
+    memcpy(snap->ctrl + first, table->ctrl + first, MEMDEBUG_GROUP_WIDTH);
+    memcpy(snap->slots + first, table->slots + first, sizeof(MemAlloc) * MEMDEBUG_GROUP_WIDTH);
+    snap->saved[group / 64] |= bit;
+}
+
+static inline void
+table_erase(AllocTable* table, size_t idx) {
+    if (table->snap)
+        table_snap_save(table, idx);
+    // If the group was never full, no probe sequence passes through it, so the slot can become empty again.
+    const uint8_t* group = table->ctrl + (idx & ~(size_t)(MEMDEBUG_GROUP_WIDTH - 1));
+    if (group_match(group, MEMDEBUG_CTRL_EMPTY)) {
+        table->ctrl[idx] = MEMDEBUG_CTRL_EMPTY;
+        table->used--;
+        table->growth_left++;
+    } else {
+        table->ctrl[idx] = MEMDEBUG_CTRL_DELETED;
+    }
+    if (!group_match_full(group))
+        table->occupied[idx / MEMDEBUG_GROUP_WIDTH / 64] &= ~((uint64_t)1 << (idx / MEMDEBUG_GROUP_WIDTH % 64));
+}
+
+// Calls visit on every full slot from start up to end, which must be multiples of the group width.
+static inline void
+table_for_each(AllocTable* table, size_t start, size_t end, void (*visit)(MemAlloc* alloc, void* ctx), void* ctx) {
+    size_t first_group = start / MEMDEBUG_GROUP_WIDTH;
+    size_t end_group = end / MEMDEBUG_GROUP_WIDTH;
+    for (size_t w = first_group / 64; w * 64 < end_group; w++) {
+        uint64_t groups = table->occupied[w];
+        if (w == first_group / 64)
+            groups &= ~(uint64_t)0 << (first_group % 64);
+        if (end_group - w * 64 < 64)
+            groups &= ~(~(uint64_t)0 << (end_group - w * 64));
+        while (groups) {
+            size_t g = (w * 64 + bit_ctz64(groups)) * MEMDEBUG_GROUP_WIDTH;
+            groups &= groups - 1;
+            uint32_t full = group_match_full(table->ctrl + g);
+            while (full) {
+                visit(table->slots + g + bit_ctz(full), ctx);
+                full &= full - 1;
+            }
+        }
+    }
+}
+
+// The control bytes and the slots share one mapping, control bytes first. Fresh pages are all empty.
+static inline size_t
+table_bytes(size_t capacity) {
+    return capacity + sizeof(MemAlloc) * capacity + sizeof(uint64_t) * occupancy_words(capacity);
+}
+
+static inline void
+table_alloc(AllocTable* table, size_t capacity) {
+    uint8_t* pages = (uint8_t*)tracker_pages_alloc(table_bytes(capacity));
+    if (!pages) OOM(__LINE__ - 1, __func__, __FILE__, table_bytes(capacity));
+
+    table->ctrl = pages;
+    table->slots = (MemAlloc*)(pages + capacity);
+    table->occupied = (uint64_t*)(table->slots + capacity);
+    table->capacity = capacity;
+    table->used = 0;
+    table->growth_left = table_growth_limit(capacity);
+    table->snap = NULL;
+}
+
+static inline void
+table_free(AllocTable* table) {
+    if (table->snap)
+        table->snap->orphaned = true;
+    else if (table->capacity)
+        tracker_pages_free(table->ctrl, table_bytes(table->capacity));
+    memset(table, 0, sizeof(AllocTable));
+}
+
+// Put a record into a slot that is known to be empty or deleted.
+static inline void
+table_set(AllocTable* table, size_t idx, size_t hash, MemAlloc alloc) {
+    if (table->snap)
+        table_snap_save(table, idx);
+    if (table->ctrl[idx] == MEMDEBUG_CTRL_EMPTY)
+        table->growth_left--;
+    else
+        table->used--;
+    table->used++;
+    table->ctrl[idx] = MEMDEBUG_CTRL_FULL | (uint8_t)(hash & 0x7F);
+    table->slots[idx] = alloc;
+    table->occupied[idx / MEMDEBUG_GROUP_WIDTH / 64] |= (uint64_t)1 << (idx / MEMDEBUG_GROUP_WIDTH % 64);
+}
+
+// Move up to budget slots (rounded up to whole groups) out of the old table.
+static inline void
+map_migrate(AllocMap* map, size_t budget) {
+    if (!map->old.capacity)
+        return;
+
+    size_t end = map->old.capacity - map->migrated > budget ? map->migrated + budget : map->old.capacity;
+    for (; map->migrated < end; map->migrated += MEMDEBUG_GROUP_WIDTH) {
+        uint32_t full = group_match_full(map->old.ctrl + map->migrated);
+        while (full) {
+            size_t idx = map->migrated + bit_ctz(full);
+            full &= full - 1;
+            size_t hash = shard_hash(ptr_hash(memalloc_ptr(&map->old.slots[idx])));
+            size_t probe_length;
+            table_set(&map->table, table_find_insert_slot(&map->table, hash, &probe_length), hash, map->old.slots[idx]);
+        }
+    }
+
+    if (map->migrated >= map->old.capacity)
+        table_free(&map->old);
+}
+
+// Start moving into a new table with room for at least twice the live allocations, dropping deleted slots.
+static inline void
+map_grow(AllocMap* map, size_t live) {
+    // Only one migration runs at a time. If the new table filled up before the old one drained, finish it now.
+    map_migrate(map, SIZE_MAX);
+
+    size_t capacity = map->table.capacity ? map->table.capacity : MEMDEBUG_MIN_CAPACITY;
+    while (table_growth_limit(capacity) / 2 < live + 1)
+        capacity *= 2;
+
+    map->old = map->table;
+    map->migrated = 0;
+    table_alloc(&map->table, capacity);
+
+    if (!MEMDEBUG_REHASH_STEP)
+        map_migrate(map, SIZE_MAX);
+}
+
+static inline void
+map_add(AllocMap* map, size_t hash, size_t live, MemAlloc alloc) {
+    map_migrate(map, MEMDEBUG_REHASH_STEP);
+    if (!map->table.growth_left)
+        map_grow(map, live);
+
+    size_t probe_length;
+    size_t idx = table_find_insert_slot(&map->table, hash, &probe_length);
+    table_set(&map->table, idx, hash, alloc);
+
+    // A long probe means the hash is clustering. Grow early so the next inserts stay short.
+    if (probe_length > MEMDEBUG_MAX_PROBE_LENGTH && !map->old.capacity && map->table.used * 4 > map->table.capacity)
+        map_grow(map, table_growth_limit(map->table.capacity) / 2);
+}
+
+static inline bool
+map_remove(AllocMap* map, void* ptr, size_t hash, MemAlloc* removed) {
+    map_migrate(map, MEMDEBUG_REHASH_STEP);
+
+    AllocTable* table = &map->table;
+    size_t idx = table_find(table, ptr, hash);
+    if (idx == table->capacity) {
+        // Not migrated yet, or not there at all. Slots below map->migrated were copied to the
+        // new table and left behind, so a match there is stale: a double free, not a record.
+        table = &map->old;
+        idx = table_find(table, ptr, hash);
+        if (idx == table->capacity || idx < map->migrated)
+            return false;
+    }
+
+    *removed = table->slots[idx];
+    table_erase(table, idx);
+    return true;
+}
+
+static inline void
+alloc_add(MemAlloc alloc) {
+    size_t hash = ptr_hash(memalloc_ptr(&alloc));
+    AllocShard* shard = alloc_shard(hash);
+
+    mutex_lock(&shard->mutex);
+    shard->num_allocs++;
+    map_add(&shard->map, shard_hash(hash), shard->num_allocs, alloc);
+    mutex_unlock(&shard->mutex);
+}
+
+// returns the pointer, or NULL if not found.
+static inline bool
+alloc_remove(void* ptr, MemAlloc* removed) {
+    size_t hash = ptr_hash(ptr);
+    AllocShard* shard = alloc_shard(hash);
+
+    mutex_lock(&shard->mutex);
+    bool found = map_remove(&shard->map, ptr, shard_hash(hash), removed);
+    if (found)
+        shard->num_allocs--;
+    mutex_unlock(&shard->mutex);
+
+    return found;
+}
+
+// Publish several allocations, taking each shard's lock once for all of its allocations. Reorders batch.
+static inline void
+alloc_add_batch(MemAlloc* batch, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        AllocShard* shard = alloc_shard(ptr_hash(memalloc_ptr(&batch[done])));
+        mutex_lock(&shard->mutex);
+        // Everything between done and i has been looked at and belongs to another shard.
+        for (size_t i = done; i < n; i++) {
+            size_t hash = ptr_hash(memalloc_ptr(&batch[i]));
+            if (alloc_shard(hash) != shard)
+                continue;
+            shard->num_allocs++;
+            map_add(&shard->map, shard_hash(hash), shard->num_allocs, batch[i]);
+            MemAlloc temp = batch[done];
+            batch[done++] = batch[i];
+            batch[i] = temp;
+        }
+        mutex_unlock(&shard->mutex);
+    }
+}
+
+// Calls visit on every live allocation in the part-th of parts slices of every table, locking one shard at a time.
+static inline void
+alloc_for_each_part(size_t part, size_t parts, void (*visit)(MemAlloc* alloc, void* ctx), void* ctx) {
+    alloc_shards_ready();
+    for (size_t s = 0; s < alloc_shard_count; s++) {
+        AllocShard* shard = alloc_shards + s;
+        AllocMap* map = &shard->map;
+        mutex_lock(&shard->mutex);
+
+        table_for_each(&map->table, scan_slice(map->table.capacity, part, parts), scan_slice(map->table.capacity, part + 1, parts), visit, ctx);
+
+        // Slots of the old table below map.migrated have already been moved.
+        size_t start = scan_slice(map->old.capacity, part, parts);
+        table_for_each(&map->old, start > map->migrated ? start : map->migrated, scan_slice(map->old.capacity, part + 1, parts), visit, ctx);
+
+        mutex_unlock(&shard->mutex);
+    }
+}
+
+static inline void
+alloc_for_each(void (*visit)(MemAlloc* alloc, void* ctx), void* ctx) {
+    alloc_for_each_part(0, 1, visit, ctx);
+}
+
+// alloc_for_each() for the out of memory report. Skips shards whose lock is taken, and returns how many it skipped.
+static inline size_t
+alloc_for_each_nowait(void (*visit)(MemAlloc* alloc, void* ctx), void* ctx) {
+    size_t skipped = 0;
+    alloc_shards_ready();
+    for (size_t s = 0; s < alloc_shard_count; s++) {
+        AllocShard* shard = alloc_shards + s;
+        if (mutex_trylock(&shard->mutex)) {
+            skipped++;
+            continue;
+        }
+        table_for_each(&shard->map.table, 0, shard->map.table.capacity, visit, ctx);
+        table_for_each(&shard->map.old, shard->map.migrated, shard->map.old.capacity, visit, ctx);
+        mutex_unlock(&shard->mutex);
+    }
+    return skipped;
+}
+
+// Lock every shard, so that nothing in the registry changes until alloc_unlock_all().
+static inline void
+alloc_lock_all() {
+    alloc_shards_ready();
+    for (size_t s = 0; s < alloc_shard_count; s++)
+        mutex_lock(&alloc_shards[s].mutex);
+}
+
+static inline void
+alloc_unlock_all() {
+    for (size_t s = 0; s < alloc_shard_count; s++)
+        mutex_unlock(&alloc_shards[s].mutex);
+}
+
+static inline size_t
+alloc_count() {
+    size_t total = 0;
+    alloc_shards_ready();
+    for (size_t s = 0; s < alloc_shard_count; s++) {
+        mutex_lock(&alloc_shards[s].mutex);
+        total += alloc_shards[s].num_allocs;
+        mutex_unlock(&alloc_shards[s].mutex);
+    }
+    return total;
+}
+
+#else  // MEMDEBUG_LOCKFREE
+/************************************/
+/* Lock-Free Allocation Registry    */
+/************************************/
+
+/*
+ * Each table is an array of pointer keys claimed with compare and swap, with the
+ * MemAlloc records alongside. A key is 0 when the slot is empty, 1 when deleted, and 2
+ * while its record is being written. Deleted slots are reused, but never become empty
+ * again, so a probe for a pointer can stop at the first empty slot.
+ *
+ * When the newest table fills up a bigger one is pushed in front of it. Older tables
+ * take no new inserts and only drain; once empty they are unlinked, and freed after every
+ * thread that might still be walking them has moved on to a later epoch.
+ */
+#include <stdatomic.h>
+
+#define LF_KEY_EMPTY ((uintptr_t)0)
+#define LF_KEY_DELETED ((uintptr_t)1)
+#define LF_KEY_BUSY ((uintptr_t)2)
+#define LF_KEY_FIRST ((uintptr_t)3)
+#define LF_RECORD_WORDS ((sizeof(MemAlloc) + sizeof(uintptr_t) - 1) / sizeof(uintptr_t))
+#ifndef MEMDEBUG_LF_STRIPES
+#define MEMDEBUG_LF_STRIPES 16
+#endif
+
+// Live counts are spread over several cache lines so that every thread doesn't hit one counter.
+struct LFCounter;
+typedef struct LFCounter LFCounter;
+struct MEMDEBUG_ALIGNED(MEMDEBUG_CACHE_LINE) LFCounter {
+    atomic_size_t value;
+};
+
+struct LFTable;
+typedef struct LFTable LFTable;
+struct LFTable {
+    _Atomic(uintptr_t)* keys;
+    _Atomic(uintptr_t)* records;  // LF_RECORD_WORDS words per slot, so print_heap() can read them while they change
+    _Atomic(uint64_t)* occupied;  // One bit per group of slots, set while the group might hold a key
+    size_t capacity;              // A power of two
+    atomic_size_t claimed;        // Slots that are no longer empty
+    atomic_bool sealed;           // Set before the table is unlinked. Inserts back off once they see it.
+    _Atomic(LFTable*) older;
+    LFCounter live[MEMDEBUG_LF_STRIPES];
+    LFTable* retired_next;        // Limbo list, guarded by lf_retire_mutex
+    size_t retired_epoch;
+};
+
+// One per thread that has touched the registry. Never freed, but reused after the thread exits.
+struct LFThread;
+typedef struct LFThread LFThread;
+struct MEMDEBUG_ALIGNED(MEMDEBUG_CACHE_LINE) LFThread {
+    atomic_size_t epoch;  // The global epoch this thread saw when it last entered
+    atomic_bool active;   // Whether this thread is inside the registry right now
+    atomic_bool in_use;   // Whether a live thread owns this record
+    LFThread* next;
+};
+
+static _Atomic(LFTable*) lf_head = NULL;
+static _Atomic(LFThread*) lf_threads = NULL;
+static atomic_size_t lf_epoch = 0;
+static MEMDEBUG_THREAD_LOCAL LFThread* lf_self = NULL;
+static MEMDEBUG_THREAD_LOCAL size_t lf_ops = 0;
+static mutex_t lf_retire_mutex = MUTEX_INITIALIZER;
+static TrackerSlab lf_thread_slab = TRACKER_SLAB_INITIALIZER(LFThread);
+static TrackerSlab lf_table_slab = TRACKER_SLAB_INITIALIZER(LFTable);
+static LFTable* lf_limbo = NULL;
+static bool lf_snapshot_open = false;  // While a heap snapshot is read, no table is retired or freed. Guarded by lf_retire_mutex.
+static tls_key_t lf_thread_key;
+static once_t lf_thread_key_once = ONCE_INITIALIZER;
+
+static void
+lf_thread_exit(void* record) {
+    atomic_store(&((LFThread*)record)->active, false);
+    atomic_store(&((LFThread*)record)->in_use, false);
+}
+
+static void
+lf_thread_key_init(void) {
+    tls_key_create(&lf_thread_key, lf_thread_exit);
+}
+
+static inline void
+lf_register_thread() {
+    // Reuse a record left behind by a thread that has exited
+    for (LFThread* t = atomic_load(&lf_threads); t; t = t->next) {
+        bool expected = false;
+        if (!atomic_load(&t->in_use) && atomic_compare_exchange_strong(&t->in_use, &expected, true)) {
+            lf_self = t;
+            break;
+        }
+    }
+
+    if (!lf_self) {
+        LFThread* t = (LFThread*)slab_alloc(&lf_thread_slab);
+        if (!t) OOM(__LINE__ - 1, __func__, __FILE__, sizeof(LFThread));
+        atomic_store(&t->in_use, true);
+        t->next = atomic_load(&lf_threads);
+        while (!atomic_compare_exchange_weak(&lf_threads, &t->next, t))
+            ;
+        lf_self = t;
+    }
+
+    once_run(&lf_thread_key_once, lf_thread_key_init);
+    tls_set(lf_thread_key, lf_self);
+}
+
+static inline void
+lf_enter() {
+    if (!lf_self)
+        lf_register_thread();
+    atomic_store(&lf_self->active, true);
+    atomic_store(&lf_self->epoch, atomic_load(&lf_epoch));
+}
+
+static inline void
+lf_exit() {
+    atomic_store_explicit(&lf_self->active, false, memory_order_release);
+}
+
+static inline void
+lf_record_store(LFTable* table, size_t idx, MemAlloc alloc) {
+    uintptr_t words[LF_RECORD_WORDS] = {0};
+    memcpy(words, &alloc, sizeof(MemAlloc));
+    for (size_t i = 0; i < LF_RECORD_WORDS; i++)
+        atomic_store_explicit(&table->records[idx * LF_RECORD_WORDS + i], words[i], memory_order_relaxed);
+}
+
+static inline MemAlloc
+lf_record_load(LFTable* table, size_t idx) {
+    uintptr_t words[LF_RECORD_WORDS];
+    for (size_t i = 0; i < LF_RECORD_WORDS; i++)
+        words[i] = atomic_load_explicit(&table->records[idx * LF_RECORD_WORDS + i], memory_order_relaxed);
+    MemAlloc alloc;
+    memcpy(&alloc, words, sizeof(MemAlloc));
+    return alloc;
+}
+
+// Keys and records share one mapping, keys first.
+static inline size_t
+lf_table_bytes(size_t capacity) {
+    return capacity * (1 + LF_RECORD_WORDS) * sizeof(uintptr_t) + occupancy_words(capacity) * sizeof(uint64_t);
+}
+
+static inline bool
+lf_group_has_keys(LFTable* table, size_t group) {
+    for (size_t idx = group * MEMDEBUG_GROUP_WIDTH; idx < (group + 1) * MEMDEBUG_GROUP_WIDTH; idx++) {
+        if (atomic_load(&table->keys[idx]) >= LF_KEY_FIRST)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * An insert sets its group's bit after publishing the key. A remove clears the bit if the
+ * group looks empty, then looks again and sets it back if a key showed up in the meantime.
+ * Either the insert's set comes after the clear, or the second look sees its key, so a
+ * group holding a key never stays unmarked. A group can be marked while empty, which
+ * only costs the scan a look.
+ */
+static inline void
+lf_occupy(LFTable* table, size_t idx) {
+    size_t group = idx / MEMDEBUG_GROUP_WIDTH;
+    atomic_fetch_or(&table->occupied[group / 64], (uint64_t)1 << (group % 64));
+}
+
+static inline void
+lf_vacate(LFTable* table, size_t idx) {
+    size_t group = idx / MEMDEBUG_GROUP_WIDTH;
+    if (lf_group_has_keys(table, group))
+        return;
+    atomic_fetch_and(&table->occupied[group / 64], ~((uint64_t)1 << (group % 64)));
+    if (lf_group_has_keys(table, group))
+        atomic_fetch_or(&table->occupied[group / 64], (uint64_t)1 << (group % 64));
+}
+
+static inline void
+lf_table_free(LFTable* table) {
+    tracker_pages_free((void*)table->keys, lf_table_bytes(table->capacity));
+    slab_free(&lf_table_slab, table);
+}
+
+// Advance the epoch if every thread inside the registry has seen the current one,
+// free tables retired two epochs ago, and retire drained tables. Needs lf_retire_mutex.
+static inline void
+lf_reclaim() {
+    if (lf_snapshot_open)
+        return;
+    size_t epoch = atomic_load(&lf_epoch);
+    bool can_advance = true;
+    for (LFThread* t = atomic_load(&lf_threads); t; t = t->next) {
+        if (atomic_load(&t->active) && atomic_load(&t->epoch) != epoch) {
+            can_advance = false;
+            break;
+        }
+    }
+    if (can_advance)
+        atomic_compare_exchange_strong(&lf_epoch, &epoch, epoch + 1);
+    epoch = atomic_load(&lf_epoch);
+
+    LFTable** limbo = &lf_limbo;
+    while (*limbo) {
+        LFTable* table = *limbo;
+        if (table->retired_epoch + 2 <= epoch) {
+            *limbo = table->retired_next;
+            lf_table_free(table);
+        } else {
+            limbo = &table->retired_next;
+        }
+    }
+
+    // The head table is never retired. Only this function unlinks tables, so prev->older is stable.
+    LFTable* prev = atomic_load(&lf_head);
+    if (!prev)
+        return;
+    for (LFTable* table = atomic_load(&prev->older); table; table = atomic_load(&prev->older)) {
+        atomic_store(&table->sealed, true);
+        size_t live = 0;
+        for (size_t i = 0; i < MEMDEBUG_LF_STRIPES; i++)
+            live += atomic_load(&table->live[i].value);
+
+        if (live) {
+            prev = table;
+        } else {
+            atomic_store(&prev->older, atomic_load(&table->older));
+            table->retired_epoch = epoch;
+            table->retired_next = lf_limbo;
+            lf_limbo = table;
+        }
+    }
+}
+
+static inline size_t
+lf_count() {
+    size_t live = 0;
+    for (LFTable* table = atomic_load(&lf_head); table; table = atomic_load(&table->older))
+        for (size_t i = 0; i < MEMDEBUG_LF_STRIPES; i++)
+            live += atomic_load(&table->live[i].value);
+    return live;
+}
+
+// Push a new head table sized for the current live count, unless another thread already has.
+static inline void
+lf_grow(LFTable* full) {
+    size_t capacity = MEMDEBUG_MIN_CAPACITY;
+    size_t live = lf_count();
+    while (capacity < live * 4)
+        capacity *= 2;
+
+    LFTable* table = (LFTable*)slab_alloc(&lf_table_slab);
+    if (!table) OOM(__LINE__ - 1, __func__, __FILE__, sizeof(LFTable));
+    table->keys = (_Atomic(uintptr_t)*)tracker_pages_alloc(lf_table_bytes(capacity));
+    if (!table->keys) OOM(__LINE__ - 1, __func__, __FILE__, lf_table_bytes(capacity));
+    table->records = table->keys + capacity;
+    table->occupied = (_Atomic(uint64_t)*)(table->records + capacity * LF_RECORD_WORDS);
+    table->capacity = capacity;
+    atomic_store(&table->older, full);
+
+    LFTable* expected = full;
+    if (!atomic_compare_exchange_strong(&lf_head, &expected, table))
+        lf_table_free(table);
+}
+
+static inline void
+alloc_add(MemAlloc alloc) {
+    size_t hash = ptr_hash(memalloc_ptr(&alloc));
+    lf_enter();
+
+    for (;;) {
+        LFTable* table = atomic_load(&lf_head);
+        if (!table) {
+            lf_grow(NULL);
+            continue;
+        }
+
+        // Count the insert before claiming a slot, so that lf_reclaim() either sees it or we see the seal.
+        atomic_size_t* live = &table->live[hash % MEMDEBUG_LF_STRIPES].value;
+        atomic_fetch_add(live, 1);
+        if (atomic_load(&table->sealed) || atomic_load(&lf_head) != table) {
+            atomic_fetch_sub(live, 1);
+            continue;
+        }
+
+        size_t mask = table->capacity - 1;
+        size_t limit = table_growth_limit(table->capacity);
+        for (size_t i = 0; i <= mask && atomic_load_explicit(&table->claimed, memory_order_relaxed) < limit; i++) {
+            size_t idx = (hash + i) & mask;
+            uintptr_t key = atomic_load_explicit(&table->keys[idx], memory_order_relaxed);
+            if (key != LF_KEY_EMPTY && key != LF_KEY_DELETED)
+                continue;
+            if (!atomic_compare_exchange_strong(&table->keys[idx], &key, LF_KEY_BUSY))
+                continue;
+
+            if (key == LF_KEY_EMPTY)
+                atomic_fetch_add_explicit(&table->claimed, 1, memory_order_relaxed);
+            lf_record_store(table, idx, alloc);
+            atomic_store_explicit(&table->keys[idx], (uintptr_t)memalloc_ptr(&alloc), memory_order_release);
+            lf_occupy(table, idx);
+            lf_exit();
+
+            if (++lf_ops % 1024 == 0 && !mutex_trylock(&lf_retire_mutex)) {
+                lf_reclaim();
+                mutex_unlock(&lf_retire_mutex);
+            }
+            return;
+        }
+
+        // Full. Move on to a bigger table.
+        atomic_fetch_sub(live, 1);
+        lf_grow(table);
+    }
+}
+
+// returns the pointer, or NULL if not found.
+static inline bool
+alloc_remove(void* ptr, MemAlloc* removed) {
+    if ((uintptr_t)ptr < LF_KEY_FIRST)
+        return false;
+
+    size_t hash = ptr_hash(ptr);
+    bool found = false;
+    lf_enter();
+
+    for (LFTable* table = atomic_load(&lf_head); table && !found; table = atomic_load(&table->older)) {
+        size_t mask = table->capacity - 1;
+        for (size_t i = 0; i <= mask; i++) {
+            size_t idx = (hash + i) & mask;
+            uintptr_t key = atomic_load_explicit(&table->keys[idx], memory_order_acquire);
+            if (key == LF_KEY_EMPTY)
+                break;
+            if (key != (uintptr_t)ptr)
+                continue;
+            // Only the thread freeing ptr can remove it, so this can't fail, and the record can't change under us.
+            *removed = lf_record_load(table, idx);
+            atomic_store_explicit(&table->keys[idx], LF_KEY_DELETED, memory_order_release);
+            atomic_fetch_sub(&table->live[hash % MEMDEBUG_LF_STRIPES].value, 1);
+            lf_vacate(table, idx);
+            found = true;
+            break;
+        }
+    }
+
+    lf_exit();
+    return found;
+}
+
+static inline void
+alloc_add_batch(MemAlloc* batch, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        alloc_add(batch[i]);
+}
+
+/*
+ * Walks every table while other threads keep inserting and removing. A record that is
+ * removed and replaced while it's being copied is skipped, so the walk sees each
+ * allocation that stays live throughout, and may or may not see ones that come and go.
+ */
+static inline void
+lf_for_each_part(size_t part, size_t parts, void (*visit)(MemAlloc* alloc, void* ctx), void* ctx) {
+    lf_enter();
+    for (LFTable* table = atomic_load(&lf_head); table; table = atomic_load(&table->older)) {
+        size_t words = occupancy_words(table->capacity);
+        for (size_t w = words * part / parts; w < words * (part + 1) / parts; w++) {
+            uint64_t groups = atomic_load(&table->occupied[w]);
+            while (groups) {
+                size_t start = (w * 64 + bit_ctz64(groups)) * MEMDEBUG_GROUP_WIDTH;
+                groups &= groups - 1;
+                for (size_t idx = start; idx < start + MEMDEBUG_GROUP_WIDTH; idx++) {
+                    uintptr_t key = atomic_load_explicit(&table->keys[idx], memory_order_acquire);
+                    if (key < LF_KEY_FIRST)
+                        continue;
+                    MemAlloc alloc = lf_record_load(table, idx);
+                    atomic_thread_fence(memory_order_acquire);
+                    if (atomic_load_explicit(&table->keys[idx], memory_order_relaxed) != key || memalloc_ptr(&alloc) != (void*)key)
+                        continue;
+                    visit(&alloc, ctx);
+                }
+            }
+        }
+    }
+    lf_exit();
+}
+
+static inline void
+alloc_for_each_part(size_t part, size_t parts, void (*visit)(MemAlloc* alloc, void* ctx), void* ctx) {
+    lf_for_each_part(part, parts, visit, ctx);
+
+    mutex_lock(&lf_retire_mutex);
+    lf_reclaim();
+    mutex_unlock(&lf_retire_mutex);
+}
+
+/*
+ * Read the live records of the next marked group at or after slot, moving on to older
+ * tables as each one runs out, and leave table and slot just past it. Returns how many
+ * records it read, or 0 once there are no tables left. The caller has a heap snapshot open,
+ * so that no table it may be pointing into is freed.
+ */
+static inline size_t
+lf_read_group(LFTable** table, size_t* slot, MemAlloc* out) {
+    while (*table) {
+        LFTable* t = *table;
+        size_t end_group = t->capacity / MEMDEBUG_GROUP_WIDTH;
+        for (size_t g = *slot / MEMDEBUG_GROUP_WIDTH; g < end_group; g++) {
+            uint64_t groups = atomic_load(&t->occupied[g / 64]) & (~(uint64_t)0 << (g % 64));
+            if (!groups) {
+                g = g / 64 * 64 + 63;
+                continue;
+            }
+            g = g / 64 * 64 + bit_ctz64(groups);
+            if (g >= end_group)
+                break;
+
+            size_t n = 0;
+            for (size_t idx = g * MEMDEBUG_GROUP_WIDTH; idx < (g + 1) * MEMDEBUG_GROUP_WIDTH; idx++) {
+                uintptr_t key = atomic_load_explicit(&t->keys[idx], memory_order_acquire);
+                if (key < LF_KEY_FIRST)
+                    continue;
+                out[n] = lf_record_load(t, idx);
+                atomic_thread_fence(memory_order_acquire);
+                if (atomic_load_explicit(&t->keys[idx], memory_order_relaxed) == key && memalloc_ptr(&out[n]) == (void*)key)
+                    n++;
+            }
+            if (n) {
+                *slot = (g + 1) * MEMDEBUG_GROUP_WIDTH;
+                return n;
+            }
+        }
+        *table = atomic_load(&t->older);
+        *slot = 0;
+    }
+    return 0;
+}
+
+static inline void
+alloc_for_each(void (*visit)(MemAlloc* alloc, void* ctx), void* ctx) {
+    alloc_for_each_part(0, 1, visit, ctx);
+}
+
+// The walk never waits, but reclaiming would.
+static inline size_t
+alloc_for_each_nowait(void (*visit)(MemAlloc* alloc, void* ctx), void* ctx) {
+    lf_for_each_part(0, 1, visit, ctx);
+    return 0;
+}
+
+// Inserts and removals never lock, so this only keeps tables from being reclaimed.
+static inline void
+alloc_lock_all() {
+    mutex_lock(&lf_retire_mutex);
+}
+
+static inline void
+alloc_unlock_all() {
+    mutex_unlock(&lf_retire_mutex);
+}
+
+static inline size_t
+alloc_count() {
+    return lf_count();
+}
+#endif  // MEMDEBUG_LOCKFREE
+
+/*******************************/
+/* Per-Thread Allocation Logs */
+/*******************************/
+
+/*
+ * Most allocations are freed by the thread that made them, shortly after. Each thread keeps
+ * its MEMDEBUG_THREAD_CACHE most recent allocations in a log of its own, and a free() that
+ * finds its pointer there never touches the shared table. When the log fills up, its older
+ * half is published to the shared table in one batch. The rest is published when the thread
+ * exits, or when a heap report needs everything. Set it to 0 to track every allocation in
+ * the shared table directly.
+ */
+#ifndef MEMDEBUG_THREAD_CACHE
+#define MEMDEBUG_THREAD_CACHE 32
+#endif
+
+#if MEMDEBUG_THREAD_CACHE
+struct ThreadLog;
+typedef struct ThreadLog ThreadLog;
+struct ThreadLog {
+    mutex_t mutex;  // Uncontended unless another thread is flushing or freeing from this log
+    size_t count;
+    void* ptrs[MEMDEBUG_THREAD_CACHE];        // The entries' pointers, packed together so they're quick to search
+    MemAlloc entries[MEMDEBUG_THREAD_CACHE];  // Oldest first
+    bool in_use;    // Whether a live thread owns this log. Guarded by thread_logs_mutex.
+    ThreadLog* next;
+};
+
+static ThreadLog* thread_logs = NULL;
+static mutex_t thread_logs_mutex = MUTEX_INITIALIZER;
+static MEMDEBUG_THREAD_LOCAL ThreadLog* thread_log = NULL;
+static TrackerSlab thread_log_slab = TRACKER_SLAB_INITIALIZER(ThreadLog);
+static tls_key_t thread_log_key;
+static once_t thread_log_key_once = ONCE_INITIALIZER;
+
+// Publish the oldest n entries of a log to the shared table. Needs the log's mutex.
+static inline void
+thread_log_publish(ThreadLog* log, size_t n) {
+    alloc_add_batch(log->entries, n);
+    memmove(log->entries, log->entries + n, sizeof(MemAlloc) * (log->count - n));
+    memmove(log->ptrs, log->ptrs + n, sizeof(void*) * (log->count - n));
+    log->count -= n;
+}
+
+static void
+thread_log_exit(void* ctx) {
+    ThreadLog* log = (ThreadLog*)ctx;
+    mutex_lock(&log->mutex);
+    thread_log_publish(log, log->count);
+    mutex_unlock(&log->mutex);
+
+    mutex_lock(&thread_logs_mutex);
+    log->in_use = false;
+    mutex_unlock(&thread_logs_mutex);
+}
+
+static void
+thread_log_key_init(void) {
+    tls_key_create(&thread_log_key, thread_log_exit);
+}
+
+static inline ThreadLog*
+thread_log_get() {
+    if (thread_log)
+        return thread_log;
+
+    // Take over the log of a thread that has exited, or make a new one.
+    mutex_lock(&thread_logs_mutex);
+    for (ThreadLog* log = thread_logs; log; log = log->next) {
+        if (!log->in_use) {
+            log->in_use = true;
+            thread_log = log;
+            break;
+        }
+    }
+    if (!thread_log) {
+        ThreadLog* log = (ThreadLog*)slab_alloc(&thread_log_slab);
+        if (!log) OOM(__LINE__ - 1, __func__, __FILE__, sizeof(ThreadLog));
+        mutex_init(&log->mutex);
+        log->in_use = true;
+        log->next = thread_logs;
+        thread_logs = log;
+        thread_log = log;
+    }
+    mutex_unlock(&thread_logs_mutex);
+
+    once_run(&thread_log_key_once, thread_log_key_init);
+    tls_set(thread_log_key, thread_log);
+    return thread_log;
+}
+
+// Remove ptr from a log if it's there. Needs the log's mutex.
+static inline bool
+thread_log_take(ThreadLog* log, void* ptr, MemAlloc* removed) {
+    // Newest first, since that's what's most likely to be freed.
+    for (size_t i = log->count; i > 0; i--) {
+        if (log->ptrs[i - 1] == ptr) {
+            *removed = log->entries[i - 1];
+            memmove(log->entries + i - 1, log->entries + i, sizeof(MemAlloc) * (log->count - i));
+            memmove(log->ptrs + i - 1, log->ptrs + i, sizeof(void*) * (log->count - i));
+            log->count--;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Publish every thread's log, so that the shared table holds every live allocation.
+static inline void
+thread_logs_flush() {
+    mutex_lock(&thread_logs_mutex);
+    for (ThreadLog* log = thread_logs; log; log = log->next) {
+        mutex_lock(&log->mutex);
+        thread_log_publish(log, log->count);
+        mutex_unlock(&log->mutex);
+    }
+    mutex_unlock(&thread_logs_mutex);
+}
+
+static inline void
+thread_log_add(MemAlloc alloc) {
+    ThreadLog* log = thread_log_get();
+    mutex_lock(&log->mutex);
+    if (log->count == MEMDEBUG_THREAD_CACHE)
+        thread_log_publish(log, (MEMDEBUG_THREAD_CACHE + 1) / 2);
+    log->ptrs[log->count] = memalloc_ptr(&alloc);
+    log->entries[log->count++] = alloc;
+    mutex_unlock(&log->mutex);
+}
+
+// returns whether the pointer was being tracked, and if so its record.
+static inline bool
+thread_log_remove(void* ptr, MemAlloc* removed) {
+    if (!ptr)
+        return false;
+
+    ThreadLog* own = thread_log_get();
+    mutex_lock(&own->mutex);
+    bool found = thread_log_take(own, ptr, removed);
+    mutex_unlock(&own->mutex);
+    if (found || alloc_remove(ptr, removed))
+        return true;
+
+    // Made by another thread and not published yet. Look through the other threads' logs.
+    mutex_lock(&thread_logs_mutex);
+    for (ThreadLog* log = thread_logs; log && !found; log = log->next) {
+        if (log == own)
+            continue;
+        mutex_lock(&log->mutex);
+        found = thread_log_take(log, ptr, removed);
+        mutex_unlock(&log->mutex);
+    }
+    mutex_unlock(&thread_logs_mutex);
+
+    // It may have been published while we were looking.
+    return found || alloc_remove(ptr, removed);
+}
+
+// Lock every log, so that nothing moves between the logs and the shared table until thread_logs_unlock().
+static inline size_t
+thread_logs_lock() {
+    size_t num_logs = 0;
+    mutex_lock(&thread_logs_mutex);
+    for (ThreadLog* log = thread_logs; log; log = log->next) {
+        mutex_lock(&log->mutex);
+        num_logs++;
+    }
+    return num_logs;
+}
+
+// Copy every log's entries out, which needs thread_logs_lock(). Returns how many there were.
+static inline size_t
+thread_logs_copy(MemAlloc* out) {
+    size_t n = 0;
+    for (ThreadLog* log = thread_logs; log; log = log->next) {
+        memcpy(out + n, log->entries, sizeof(MemAlloc) * log->count);
+        n += log->count;
+    }
+    return n;
+}
+
+static inline void
+thread_logs_unlock() {
+    for (ThreadLog* log = thread_logs; log; log = log->next)
+        mutex_unlock(&log->mutex);
+    mutex_unlock(&thread_logs_mutex);
+}
+
+// Calls visit on every log's entries without publishing them, for the out of memory report.
+// Skips logs whose lock is taken, and returns how many it skipped.
+static inline size_t
+thread_logs_for_each_nowait(void (*visit)(MemAlloc* alloc, void* ctx), void* ctx) {
+    if (mutex_trylock(&thread_logs_mutex))
+        return 1;
+    size_t skipped = 0;
+    for (ThreadLog* log = thread_logs; log; log = log->next) {
+        if (mutex_trylock(&log->mutex)) {
+            skipped++;
+            continue;
+        }
+        for (size_t i = 0; i < log->count; i++)
+            visit(log->entries + i, ctx);
+        mutex_unlock(&log->mutex);
+    }
+    mutex_unlock(&thread_logs_mutex);
+    return skipped;
+}
+
+#else  // MEMDEBUG_THREAD_CACHE
+static inline void thread_logs_flush() {}
+static inline size_t thread_logs_lock() { return 0; }
+static inline size_t thread_logs_copy(MemAlloc* out) {
+    (void)out;
+    return 0;
+}
+static inline void thread_logs_unlock() {}
+static inline size_t thread_logs_for_each_nowait(void (*visit)(MemAlloc* alloc, void* ctx), void* ctx) {
+    (void)visit;
+    (void)ctx;
+    return 0;
+}
+static inline void thread_log_add(MemAlloc alloc) { alloc_add(alloc); }
+static inline bool thread_log_remove(void* ptr, MemAlloc* removed) { return alloc_remove(ptr, removed); }
+#endif
+
+/******************/
+/* Heap Snapshots */
+/******************/
+
+/*
+ * A heap snapshot is every allocation that was live at one instant, which print_heap_exact()
+ * reads while the program goes on allocating. Taking one holds the locks only long enough to
+ * copy the thread logs and mark each table copy on write. Reading it takes a shard's lock for
+ * one bitmap word of groups at a time, and a malloc() or free() that lands in a group the
+ * snapshot hasn't saved yet copies that one group first. One snapshot is read at a time.
+ */
+static mutex_t heap_snapshot_mutex = MUTEX_INITIALIZER;
+static MEMDEBUG_THREAD_LOCAL MemdebugIter* heap_walk = NULL;  // The walk this thread holds it for
+
+#if !MEMDEBUG_LOCKFREE
+struct HeapSnapshot;
+typedef struct HeapSnapshot HeapSnapshot;
+struct HeapSnapshot {
+    MemAlloc* logged;   // The thread logs' entries, which weren't in any table yet
+    size_t num_logged;
+    size_t logged_capacity;
+};
+
+static HeapSnapshot heap_snapshot;
+
+// Start a snapshot of a table, which needs its shard's lock.
+static inline void
+table_snap_begin(AllocTable* table, TableSnapshot* snap, size_t start) {
+    // The copy has the same layout as the table, with the bitmap marking saved groups instead of occupied ones.
+    uint8_t* pages = (uint8_t*)tracker_pages_alloc(table_bytes(table->capacity));
+    if (!pages) OOM(__LINE__ - 1, __func__, __FILE__, table_bytes(table->capacity));
+
+    snap->table = *table;
+    snap->start = start;
+    snap->ctrl = pages;
+    snap->slots = (MemAlloc*)(pages + table->capacity);
+    snap->saved = (uint64_t*)(snap->slots + table->capacity);
+    snap->orphaned = false;
+    table->snap = snap;
+}
+
+// Finish a table's snapshot, which needs its shard's lock.
+static inline void
+table_snap_end(AllocMap* map, TableSnapshot* snap) {
+    if (!snap->table.capacity)
+        return;
+    if (snap->orphaned)
+        tracker_pages_free(snap->table.ctrl, table_bytes(snap->table.capacity));
+    else if (map->table.snap == snap)
+        map->table.snap = NULL;
+    else if (map->old.snap == snap)
+        map->old.snap = NULL;
+    tracker_pages_free(snap->ctrl, table_bytes(snap->table.capacity));
+    memset(snap, 0, sizeof(TableSnapshot));
+}
+
+// Where group g's contents were when the snapshot was taken: in the saved copy, or still in the table.
+static inline MemAlloc*
+table_snap_group(TableSnapshot* snap, size_t g, uint32_t* full) {
+    bool saved = (snap->saved[g / 64] >> (g % 64)) & 1;
+    size_t first = g * MEMDEBUG_GROUP_WIDTH;
+    *full = group_match_full((saved ? snap->ctrl : snap->table.ctrl) + first);
+    return (saved ? snap->slots : snap->table.slots) + first;
+}
+
+// Calls visit on every slot that was full when the snapshot was taken, from start up to end.
+static inline void
+table_snap_for_each(TableSnapshot* snap, mutex_t* mutex, size_t start, size_t end, void (*visit)(MemAlloc* alloc, void* ctx), void* ctx) {
+    AllocTable* table = &snap->table;
+    if (start < snap->start)
+        start = snap->start;
+    size_t first_group = start / MEMDEBUG_GROUP_WIDTH;
+    size_t end_group = end / MEMDEBUG_GROUP_WIDTH;
+    for (size_t w = first_group / 64; w * 64 < end_group; w++) {
+        mutex_lock(mutex);
+        // Every group that was occupied is either still occupied or has been saved.
+        uint64_t groups = table->occupied[w] | snap->saved[w];
+        if (w == first_group / 64)
+            groups &= ~(uint64_t)0 << (first_group % 64);
+        if (end_group - w * 64 < 64)
+            groups &= ~(~(uint64_t)0 << (end_group - w * 64));
+        while (groups) {
+            uint32_t full;
+            MemAlloc* slots = table_snap_group(snap, w * 64 + bit_ctz64(groups), &full);
+            groups &= groups - 1;
+            while (full) {
+                visit(slots + bit_ctz(full), ctx);
+                full &= full - 1;
+            }
+        }
+        mutex_unlock(mutex);
+    }
+}
+
+// Take a snapshot, which needs heap_snapshot_mutex.
+static inline void
+heap_snapshot_take() {
+    // Nothing can move between the logs and the tables while every lock is held.
+    size_t num_logs = thread_logs_lock();
+    alloc_lock_all();
+
+    heap_snapshot.logged_capacity = num_logs * MEMDEBUG_THREAD_CACHE;
+    heap_snapshot.logged = NULL;
+    if (heap_snapshot.logged_capacity) {
+        heap_snapshot.logged = (MemAlloc*)tracker_pages_alloc(sizeof(MemAlloc) * heap_snapshot.logged_capacity);
+        if (!heap_snapshot.logged) OOM(__LINE__ - 1, __func__, __FILE__, sizeof(MemAlloc) * heap_snapshot.logged_capacity);
+    }
+    heap_snapshot.num_logged = thread_logs_copy(heap_snapshot.logged);
+
+    for (size_t s = 0; s < alloc_shard_count; s++) {
+        AllocShard* shard = alloc_shards + s;
+        if (shard->map.table.capacity)
+            table_snap_begin(&shard->map.table, &shard->snaps[0], 0);
+        // Slots of the old table below map.migrated have already been moved.
+        if (shard->map.old.capacity)
+            table_snap_begin(&shard->map.old, &shard->snaps[1], shard->map.migrated);
+    }
+
+    alloc_unlock_all();
+    thread_logs_unlock();
+}
+
+static inline void
+heap_snapshot_begin() {
+    mutex_lock(&heap_snapshot_mutex);
+    heap_snapshot_take();
+}
+
+// Calls visit on every allocation in the part-th of parts slices of the snapshot.
+static inline void
+heap_snapshot_for_each_part(size_t part, size_t parts, void (*visit)(MemAlloc* alloc, void* ctx), void* ctx) {
+    for (size_t s = 0; s < alloc_shard_count; s++) {
+        AllocShard* shard = alloc_shards + s;
+        for (size_t t = 0; t < 2; t++) {
+            TableSnapshot* snap = &shard->snaps[t];
+            size_t capacity = snap->table.capacity;
+            if (capacity)
+                table_snap_for_each(snap, &shard->mutex, scan_slice(capacity, part, parts), scan_slice(capacity, part + 1, parts), visit, ctx);
+        }
+    }
+    if (part == 0) {
+        for (size_t i = 0; i < heap_snapshot.num_logged; i++)
+            visit(heap_snapshot.logged + i, ctx);
+    }
+}
+
+// The copies are freed in the reverse order they were made, so pages from the OOM reserve go back to it.
+static inline void
+heap_snapshot_end() {
+    for (size_t s = alloc_shard_count; s-- > 0;) {
+        AllocShard* shard = alloc_shards + s;
+        mutex_lock(&shard->mutex);
+        table_snap_end(&shard->map, &shard->snaps[1]);
+        table_snap_end(&shard->map, &shard->snaps[0]);
+        mutex_unlock(&shard->mutex);
+    }
+    tracker_pages_free(heap_snapshot.logged, sizeof(MemAlloc) * heap_snapshot.logged_capacity);
+    mutex_unlock(&heap_snapshot_mutex);
+}
+
+// Where heap_snapshot_read() starts.
+static inline void
+heap_snapshot_cursor(size_t* cursor) {
+    cursor[0] = 0;  // Shard times two, plus one for the old table
+    cursor[1] = 0;  // Slot in that table, or entry in the logs once the tables are done
+}
+
+// Read the records of the next group that held any when the snapshot was taken, and then the
+// thread logs' entries a group's worth at a time. Returns 0 once everything has been read.
+static inline size_t
+heap_snapshot_read(size_t* cursor, MemAlloc* out) {
+    for (; cursor[0] < 2 * alloc_shard_count; cursor[0]++, cursor[1] = 0) {
+        AllocShard* shard = alloc_shards + cursor[0] / 2;
+        TableSnapshot* snap = &shard->snaps[cursor[0] % 2];
+        size_t end_group = snap->table.capacity / MEMDEBUG_GROUP_WIDTH;
+        size_t g = (cursor[1] > snap->start ? cursor[1] : snap->start) / MEMDEBUG_GROUP_WIDTH;
+        while (g < end_group) {
+            size_t n = 0;
+            mutex_lock(&shard->mutex);
+            uint64_t groups = (snap->table.occupied[g / 64] | snap->saved[g / 64]) & (~(uint64_t)0 << (g % 64));
+            if (groups) {
+                uint32_t full;
+                g = g / 64 * 64 + bit_ctz64(groups);
+                MemAlloc* slots = table_snap_group(snap, g++, &full);
+                for (; full; full &= full - 1)
+                    out[n++] = slots[bit_ctz(full)];
+            } else {
+                g = g / 64 * 64 + 64;
+            }
+            mutex_unlock(&shard->mutex);
+            if (n) {
+                cursor[1] = g * MEMDEBUG_GROUP_WIDTH;
+                return n;
+            }
+        }
+    }
+
+    size_t n = heap_snapshot.num_logged - cursor[1];
+    if (n > MEMDEBUG_GROUP_WIDTH)
+        n = MEMDEBUG_GROUP_WIDTH;
+    if (n)
+        memcpy(out, heap_snapshot.logged + cursor[1], sizeof(MemAlloc) * n);
+    cursor[1] += n;
+    return n;
+}
+
+#else  // MEMDEBUG_LOCKFREE
+// The lock-free registry's scan never blocks the program to begin with, but it isn't one
+// instant's view: allocations made or freed during the scan may or may not be counted.
+// lf_snapshot_open keeps every table the scan might be in from being freed. It's a flag rather
+// than lf_retire_mutex held throughout, since memdebug_iter_begin()'s caller runs its own code
+// in between, which can take memdebug's other locks.
+static inline void
+heap_snapshot_take() {
+    thread_logs_flush();
+    mutex_lock(&lf_retire_mutex);
+    lf_snapshot_open = true;
+    mutex_unlock(&lf_retire_mutex);
+}
+
+static inline void
+heap_snapshot_begin() {
+    mutex_lock(&heap_snapshot_mutex);
+    heap_snapshot_take();
+}
+
+static inline void
+heap_snapshot_for_each_part(size_t part, size_t parts, void (*visit)(MemAlloc* alloc, void* ctx), void* ctx) {
+    lf_for_each_part(part, parts, visit, ctx);
+}
+
+static inline void
+heap_snapshot_end() {
+    mutex_lock(&lf_retire_mutex);
+    lf_snapshot_open = false;
+    lf_reclaim();
+    mutex_unlock(&lf_retire_mutex);
+    mutex_unlock(&heap_snapshot_mutex);
+}
+
+static inline void
+heap_snapshot_cursor(size_t* cursor) {
+    cursor[0] = (size_t)(uintptr_t)atomic_load(&lf_head);  // The table being read
+    cursor[1] = 0;                                          // Slot in it
+}
+
+static inline size_t
+heap_snapshot_read(size_t* cursor, MemAlloc* out) {
+    LFTable* table = (LFTable*)(uintptr_t)cursor[0];
+    size_t n = lf_read_group(&table, &cursor[1], out);
+    cursor[0] = (size_t)(uintptr_t)table;
+    return n;
+}
+#endif
+
+/*********************/
+/* Allocation Events */
+/*********************/
+
+/*
+ * With PRINT_MEMALLOCS, every malloc(), realloc() and free() is reported as an event. Each
+ * thread drops its events into a ring of its own, and a background thread formats what's in
+ * the rings and writes it out in one batch every MEMDEBUG_EVENT_FLUSH_MS milliseconds, so the
+ * allocating threads never wait on stdout. A thread that fills its ring writes everything out
+ * itself. A thread's messages stay in order. The heap reports, mempanic() and exit write out
+ * whatever is pending before anything of their own, but the messages may trail the program's
+ * own output. Set MEMDEBUG_ASYNC_PRINT to 0 to print each message as it happens.
+ *
+ * With MEMDEBUG_TRACE, memdebug_trace_start() records the same events to a binary file as
+ * well, with when and on which thread they happened, until memdebug_trace_stop() or exit.
+ * The writer thread encodes and compresses them as it writes them out, in 4 to 7 bytes an
+ * event instead of the 120 or so a message takes. memdebug_trace.h describes the format and
+ * reads it back, and trace_decode.c turns a trace into text or CSV, or into the live heap at
+ * a given time, from the keyframe before it. trace_replay.c replays a trace against other
+ * allocators, to compare them on the program's own allocations.
+ */
+#define MEMDEBUG_EVENTS (PRINT_MEMALLOCS || MEMDEBUG_TRACE)
+#if MEMDEBUG_EVENTS
+#ifndef MEMDEBUG_ASYNC_PRINT
+#define MEMDEBUG_ASYNC_PRINT 1
+#endif
+#ifndef MEMDEBUG_EVENT_RING
+#define MEMDEBUG_EVENT_RING 4096  // Events per thread. Must be a power of 2
+#endif
+#ifndef MEMDEBUG_EVENT_FLUSH_MS
+#define MEMDEBUG_EVENT_FLUSH_MS 10
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define event_load(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define event_store(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else
+#define event_load(p) (*(volatile size_t*)(p))
+#define event_store(p, v) (*(volatile size_t*)(p) = (v))
+#endif
+
+#define MEMDEBUG_EVENT_MALLOC 0
+#define MEMDEBUG_EVENT_REALLOC 1
+#define MEMDEBUG_EVENT_FREE 2
+
+struct MemEvent;
+typedef struct MemEvent MemEvent;
+struct MemEvent {
+    int kind;
+    uint32_t thread;  // event_thread_id(), if traced
+    uint64_t time;    // clock_ns(), if traced
+    uint64_t released;  // When realloc() let go of old_ptr, if traced
+    bool traced;      // Whether the trace was recording when it happened
+    void* ptr;        // What was returned, or freed
+    void* old_ptr;    // What was passed to realloc()
+    size_t size;
+    CallSite* site;
+};
+
+// Written by its thread and read by whichever thread holds event_mutex.
+struct EventRing;
+typedef struct EventRing EventRing;
+struct EventRing {
+    size_t write;  // Events ever written. Only the owning thread changes it.
+    size_t read;   // Events ever written out. Only changed under event_mutex.
+    bool in_use;   // Whether a live thread owns this ring. Guarded by event_rings_mutex.
+    EventRing* next;
+    MemEvent* events;
+};
+
+static EventRing* event_rings = NULL;  // Pushed under event_rings_mutex, and never removed, so it can be walked without it
+static mutex_t event_rings_mutex = MUTEX_INITIALIZER;
+static mutex_t event_mutex = MUTEX_INITIALIZER;  // Serializes writing the events out
+static char event_text[65536];                   // Guarded by event_mutex
+static size_t events_done = 0;                   // Set at exit, after which events are printed as they happen. Written under event_mutex.
+static size_t events_failed = 0;                 // Set by OOM() and mempanic(), which can exit with event_mutex held
+static MEMDEBUG_THREAD_LOCAL EventRing* event_ring = NULL;
+static TrackerSlab event_ring_slab = TRACKER_SLAB_INITIALIZER(EventRing);
+static tls_key_t event_ring_key;
+static once_t events_once = ONCE_INITIALIZER;
+
+#if MEMDEBUG_TRACE
+/*
+ * The trace writer. Only the thread holding event_mutex touches it. Each event is written
+ * as a difference from the one before, so sites and strings are written once, the first
+ * time an event needs them, and times and pointers usually fit in a byte or two.
+ *
+ * The records are gathered into blocks of up to MEMDEBUG_TRACE_BLOCK bytes. Each block is
+ * compressed on its own with the LZ4 block format, unless MEMDEBUG_TRACE_COMPRESS is 0 or it
+ * doesn't shrink, and written with a header giving its sizes and the time it starts from.
+ * The differences start over in every block, so a reader can skip from header to header and
+ * decompress blocks in any order. A block is written once it's full, and the writer thread
+ * also writes the one in progress every MEMDEBUG_TRACE_FLUSH_MS milliseconds.
+ *
+ * Every MEMDEBUG_TRACE_KEYFRAME_MS milliseconds, and when the trace starts, the writer thread
+ * also records a keyframe: every live allocation, from a heap snapshot. A keyframe starts a
+ * block, and the string and site tables start over with it, so a reader can begin there. Each
+ * malloc(), realloc() and free() is timed after it changes the records, and a realloc() also
+ * has when it removed the old record, so the keyframe plus the changes timed from its time on,
+ * in time order, give the live heap at any later time. On close, an index of the keyframes
+ * goes at the end of the file.
+ */
+#ifndef MEMDEBUG_TRACE_COMPRESS
+#define MEMDEBUG_TRACE_COMPRESS 1
+#endif
+#ifndef MEMDEBUG_TRACE_FLUSH_MS
+#define MEMDEBUG_TRACE_FLUSH_MS 1000
+#endif
+#ifndef MEMDEBUG_TRACE_KEYFRAME_MS
+#define MEMDEBUG_TRACE_KEYFRAME_MS 60000
+#endif
+#define MEMDEBUG_TRACE_BLOCK 65536
+#define MEMDEBUG_TRACE_BLOCK_HEADER 17
+#define MEMDEBUG_TRACE_MAX_NAME 1024  // Longer file and function names are cut short
+#define MEMDEBUG_TRACE_MAX_EVENT 64
+#define MEMDEBUG_TRACE_VERSION 3
+#define MEMDEBUG_TRACE_STRING 0xF0
+#define MEMDEBUG_TRACE_SITE 0xF1
+#define MEMDEBUG_TRACE_KEYFRAME 0xF2
+#define MEMDEBUG_TRACE_LIVE 0xF3
+#define MEMDEBUG_TRACE_KEYFRAME_END 0xF4
+#define MEMDEBUG_TRACE_LZ4 1            // Block methods, after 0 for stored
+#define MEMDEBUG_TRACE_INDEX 2
+#define MEMDEBUG_TRACE_KEYFRAME_BLOCK 0x80  // Block flag
+#define MEMDEBUG_TRACE_NEW_THREAD 0x04   // Event flags, above the kind
+#define MEMDEBUG_TRACE_PTR_LOW 0x08      // The pointer isn't aligned, so its low bits follow
+#define MEMDEBUG_TRACE_OLD_PTR_LOW 0x10
+
+struct TraceString;
+typedef struct TraceString TraceString;
+struct TraceString {
+    const char* str;
+    uint64_t hash;
+    uint32_t id;
+};
+
+struct TraceIndexEntry;
+typedef struct TraceIndexEntry TraceIndexEntry;
+struct TraceIndexEntry {
+    uint64_t offset;  // Of its first block
+    uint64_t time;    // Since the trace started
+};
+
+struct TraceWriter;
+typedef struct TraceWriter TraceWriter;
+struct TraceWriter {
+    FILE* file;
+    uint64_t start;       // When the trace started
+    uint64_t time;        // Of the last event written, or when the trace started
+    uint64_t block_time;  // What time was when the block being written started
+    uint64_t flushed;     // When a block was last written
+    uint64_t keyframed;   // When the last keyframe was recorded
+    bool keyframe_due;    // If the last one couldn't be
+    int block_flags;      // For the block being written
+    uint32_t thread;      // Of the last event written in this block, or 0
+    uintptr_t ptr;        // The last event's pointer in this block, in units of malloc()'s alignment
+    uint8_t* sites;       // Whether each site id has been written
+    size_t sites_capacity;
+    TraceString* strings;  // The strings written, by content. A power of two, at most half full.
+    size_t strings_capacity;
+    uint32_t num_strings;
+    TraceIndexEntry* keyframes;
+    size_t num_keyframes;
+    size_t keyframes_capacity;
+
+    size_t used;
+    uint8_t buf[MEMDEBUG_TRACE_BLOCK];
+    uint8_t packed[MEMDEBUG_TRACE_BLOCK_HEADER + MEMDEBUG_TRACE_BLOCK + MEMDEBUG_TRACE_BLOCK / 255 + 16];
+    uint16_t lz_table[4096];  // Where each hash of 4 bytes was last seen in buf
+};
+
+// Kept after the trace is closed, for the benchmarks.
+struct TraceTotals;
+typedef struct TraceTotals TraceTotals;
+struct TraceTotals {
+    uint64_t raw_bytes;    // Records written, before compression
+    uint64_t file_bytes;   // What they took in the file, with the block headers
+    uint64_t compress_ns;  // Time spent compressing
+};
+
+// The writer takes about 140 KB, so it's only mapped while a trace is being recorded.
+static TraceWriter* trace = NULL;        // Guarded by event_mutex. NULL when not recording.
+static TraceTotals trace_totals;         // Guarded by event_mutex
+static size_t trace_on = 0;              // Whether new events are traced. Written under event_mutex.
+static uint32_t event_threads = 0;       // Guarded by event_rings_mutex
+static MEMDEBUG_THREAD_LOCAL uint32_t event_thread = 0;
+
+// A number for the calling thread, from 1. Unlike a ring, it isn't handed on when the thread exits.
+static inline uint32_t
+event_thread_id() {
+    if (!event_thread) {
+        mutex_lock(&event_rings_mutex);
+        event_thread = ++event_threads;
+        mutex_unlock(&event_rings_mutex);
+    }
+    return event_thread;
+}
+
+// Write one LZ4 sequence: literals, then a match to copy from offset bytes back, if there is one.
+static inline uint8_t*
+trace_lz_sequence(uint8_t* out, const uint8_t* literals, size_t num_literals, size_t offset, size_t match_len) {
+    size_t extra = match_len ? match_len - 4 : 0;
+    *out++ = (uint8_t)((num_literals < 15 ? num_literals : 15) << 4 | (extra < 15 ? extra : 15));
+    if (num_literals >= 15) {
+        size_t n = num_literals - 15;
+        for (; n >= 255; n -= 255)
+            *out++ = 255;
+        *out++ = (uint8_t)n;
+    }
+    memcpy(out, literals, num_literals);
+    out += num_literals;
+    if (!match_len)
+        return out;
+
+    *out++ = (uint8_t)offset;
+    *out++ = (uint8_t)(offset >> 8);
+    if (extra >= 15) {
+        size_t n = extra - 15;
+        for (; n >= 255; n -= 255)
+            *out++ = 255;
+        *out++ = (uint8_t)n;
+    }
+    return out;
+}
+
+// Compress src with the LZ4 block format, returning the compressed size. Greedy matching on
+// a hash of the next 4 bytes, which is fast and does well on the repetitive records of a trace.
+static inline size_t
+trace_lz_compress(const uint8_t* src, size_t len, uint8_t* dst) {
+    uint8_t* out = dst;
+    size_t anchor = 0;
+    memset(trace->lz_table, 0, sizeof(trace->lz_table));
+
+    // The format ends every block with at least 5 literals, after a match that starts at least 12 bytes from the end.
+    for (size_t i = 0; i + 12 <= len;) {
+        uint32_t next;
+        memcpy(&next, src + i, 4);
+        uint32_t h = (next * 2654435761U) >> 20;
+        size_t candidate = trace->lz_table[h];
+        trace->lz_table[h] = (uint16_t)i;
+        if (candidate >= i || memcmp(src + candidate, src + i, 4)) {
+            i++;
+            continue;
+        }
+
+        size_t end = i + 4;
+        while (end < len - 5 && src[end] == src[end - i + candidate])
+            end++;
+        out = trace_lz_sequence(out, src + anchor, i - anchor, i - candidate, end - i);
+        i = anchor = end;
+    }
+    out = trace_lz_sequence(out, src + anchor, len - anchor, 0, 0);
+    return (size_t)(out - dst);
+}
+
+static inline void
+trace_put_le(uint8_t* out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++)
+        out[i] = (uint8_t)(value >> (8 * i));
+}
+
+// Write out the block in progress and start a new one.
+static inline void
+trace_flush() {
+    if (trace->used) {
+        uint8_t* header = trace->packed;
+        size_t size = trace->used;
+        int method = 0;  // Stored
+#if MEMDEBUG_TRACE_COMPRESS
+        uint64_t start = clock_ns();
+        size_t compressed = trace_lz_compress(trace->buf, trace->used, header + MEMDEBUG_TRACE_BLOCK_HEADER);
+        trace_totals.compress_ns += clock_ns() - start;
+        if (compressed < trace->used) {
+            size = compressed;
+            method = MEMDEBUG_TRACE_LZ4;
+        }
+#endif
+        if (!method)
+            memcpy(header + MEMDEBUG_TRACE_BLOCK_HEADER, trace->buf, trace->used);
+
+        // Little endian: stored size (4 bytes), raw size (4), start time (8), method and flags (1).
+        trace_put_le(header, size, 4);
+        trace_put_le(header + 4, trace->used, 4);
+        trace_put_le(header + 8, trace->block_time - trace->start, 8);
+        header[16] = (uint8_t)(method | trace->block_flags);
+        trace->block_flags = 0;
+        fwrite(header, 1, MEMDEBUG_TRACE_BLOCK_HEADER + size, trace->file);
+        trace_totals.raw_bytes += trace->used;
+        trace_totals.file_bytes += MEMDEBUG_TRACE_BLOCK_HEADER + size;
+    }
+    trace->used = 0;
+    trace->block_time = trace->time;
+    trace->thread = 0;
+    trace->ptr = 0;
+    trace->flushed = clock_ns();
+}
+
+// Make room for a record, so that none is split between blocks.
+static inline void
+trace_reserve(size_t size) {
+    if (trace->used + size > MEMDEBUG_TRACE_BLOCK)
+        trace_flush();
+}
+
+static inline void
+trace_put_byte(uint8_t byte) {
+    trace->buf[trace->used++] = byte;
+}
+
+static inline void
+trace_put_varint(uint64_t value) {
+    while (value >= 0x80) {
+        trace_put_byte((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    trace_put_byte((uint8_t)value);
+}
+
+// Signed differences, with the sign in the low bit so that small ones of either sign stay small.
+static inline void
+trace_put_zigzag(uint64_t difference) {
+    trace_put_varint((difference << 1) ^ (uint64_t)((int64_t)difference >> 63));
+}
+
+static inline uint32_t
+trace_string(const char* str) {
+    if (trace->num_strings >= trace->strings_capacity / 2) {
+        size_t capacity = trace->strings_capacity ? trace->strings_capacity * 2 : 256;
+        TraceString* strings = (TraceString*)tracker_pages_alloc(sizeof(TraceString) * capacity);
+        if (!strings) OOM(__LINE__ - 1, __func__, __FILE__, sizeof(TraceString) * capacity);
+        memset(strings, 0, sizeof(TraceString) * capacity);
+        for (size_t i = 0; i < trace->strings_capacity; i++) {
+            TraceString* old = &trace->strings[i];
+            if (!old->str)
+                continue;
+            size_t slot = (size_t)old->hash & (capacity - 1);
+            while (strings[slot].str)
+                slot = (slot + 1) & (capacity - 1);
+            strings[slot] = *old;
+        }
+        if (trace->strings)
+            tracker_pages_free(trace->strings, sizeof(TraceString) * trace->strings_capacity);
+        trace->strings = strings;
+        trace->strings_capacity = capacity;
+    }
+
+    // FNV-1a, since the same name can be at more than one address.
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (const char* c = str; *c; c++)
+        h = (h ^ (uint8_t)*c) * 0x100000001B3ULL;
+    size_t slot = (size_t)h & (trace->strings_capacity - 1);
+    for (; trace->strings[slot].str; slot = (slot + 1) & (trace->strings_capacity - 1))
+        if (trace->strings[slot].hash == h && !strcmp(trace->strings[slot].str, str))
+            return trace->strings[slot].id;
+
+    size_t len = strlen(str);
+    if (len > MEMDEBUG_TRACE_MAX_NAME)
+        len = MEMDEBUG_TRACE_MAX_NAME;
+    trace_reserve(1 + 10 + len);
+    trace_put_byte(MEMDEBUG_TRACE_STRING);
+    trace_put_varint(len);
+    for (size_t i = 0; i < len; i++)
+        trace_put_byte((uint8_t)str[i]);
+    trace->strings[slot].str = str;
+    trace->strings[slot].hash = h;
+    trace->strings[slot].id = trace->num_strings;
+    trace->num_strings++;
+    return trace->strings[slot].id;
+}
+
+static inline uint32_t
+trace_site(CallSite* site) {
+    uint32_t id = site_id(site);
+    if (id >= trace->sites_capacity) {
+        size_t capacity = trace->sites_capacity ? trace->sites_capacity : 4096;
+        while (capacity <= id)
+            capacity *= 2;
+        uint8_t* sites = (uint8_t*)tracker_pages_alloc(capacity);
+        if (!sites) OOM(__LINE__ - 1, __func__, __FILE__, capacity);
+        memset(sites, 0, capacity);
+        if (trace->sites) {
+            memcpy(sites, trace->sites, trace->sites_capacity);
+            tracker_pages_free(trace->sites, trace->sites_capacity);
+        }
+        trace->sites = sites;
+        trace->sites_capacity = capacity;
+    }
+    if (!trace->sites[id]) {
+        uint32_t file = trace_string(site->file);
+        uint32_t func = trace_string(site->func);
+        trace_reserve(1 + 4 * 10);
+        trace_put_byte(MEMDEBUG_TRACE_SITE);
+        trace_put_varint(id);
+        trace_put_varint(file);
+        trace_put_varint(func);
+        trace_put_varint(site->line);
+        trace->sites[id] = 1;
+    }
+    return id;
+}
+
+// Write the strings and sites again as they're next needed, numbering the strings from 0.
+static inline void
+trace_forget_names() {
+    if (trace->sites)
+        memset(trace->sites, 0, trace->sites_capacity);
+    if (trace->strings)
+        memset(trace->strings, 0, sizeof(TraceString) * trace->strings_capacity);
+    trace->num_strings = 0;
+}
 
-/******************************************/
-/* Void Pointer Hash Function For Hashmap */
-/******************************************/
+static inline void
+trace_add_keyframe(uint64_t offset, uint64_t time) {
+    if (trace->num_keyframes == trace->keyframes_capacity) {
+        size_t capacity = trace->keyframes_capacity ? trace->keyframes_capacity * 2 : 256;
+        TraceIndexEntry* keyframes = (TraceIndexEntry*)tracker_pages_alloc(sizeof(TraceIndexEntry) * capacity);
+        if (!keyframes) OOM(__LINE__ - 1, __func__, __FILE__, sizeof(TraceIndexEntry) * capacity);
+        if (trace->keyframes) {
+            memcpy(keyframes, trace->keyframes, sizeof(TraceIndexEntry) * trace->num_keyframes);
+            tracker_pages_free(trace->keyframes, sizeof(TraceIndexEntry) * trace->keyframes_capacity);
+        }
+        trace->keyframes = keyframes;
+        trace->keyframes_capacity = capacity;
+    }
+    trace->keyframes[trace->num_keyframes].offset = offset;
+    trace->keyframes[trace->num_keyframes].time = time;
+    trace->num_keyframes++;
+}
 
 static inline size_t
-log_base_2(const size_t num) {
-    if (num == 1)
-        return 0;
-    return 1 + log_base_2(num / 2);
+trace_varint_len(uint64_t value) {
+    size_t len = 1;
+    for (; value >= 0x80; value >>= 7)
+        len++;
+    return len;
 }
 
-/* 
- * Note that, by all accounts, this is a bad idea. 
- * How ptr_hash behaves is entirely implementation specific because how uintptr_t is implementation specific. 
- * However, it behaves in the sane way that you'd expect across most popular compilers.
- */
-#define MAP_BUF_SIZE 100000
-static inline size_t
-ptr_hash(void* val) {
-    size_t logsize = log_base_2(1 + sizeof(void*));
-    size_t shifted = (size_t)((uintptr_t)val) >> logsize;
-    size_t other = (size_t)((uintptr_t)val) << (8 - logsize);
-    size_t xed = shifted ^ other;
-    size_t ans = xed % MAP_BUF_SIZE;
-    return ans;
+static inline void
+trace_file_varint(uint64_t value) {
+    for (; value >= 0x80; value >>= 7)
+        fputc((int)(value | 0x80) & 0xFF, trace->file);
+    fputc((int)value, trace->file);
 }
 
-/**************************************/
-/* Global Allocation Tracking Hashmap */
-/**************************************/
+// Write the keyframes' offsets and times, as differences, in a block of their own at the end
+// of the file. The last 16 bytes of the file are where that block starts and "MDINDEX\0".
+static inline void
+trace_put_index() {
+    uint64_t offset = 0, time = 0;
+    size_t len = trace_varint_len(trace->num_keyframes);
+    for (size_t i = 0; i < trace->num_keyframes; i++) {
+        len += trace_varint_len(trace->keyframes[i].offset - offset) + trace_varint_len(trace->keyframes[i].time - time);
+        offset = trace->keyframes[i].offset;
+        time = trace->keyframes[i].time;
+    }
 
-// Mutex to guard the allocation structure.
-static mutex_t alloc_mutex = MUTEX_INITIALIZER;
-#define MEMDEBUG_LOCK_MUTEX mutex_lock(&alloc_mutex);
-#define MEMDEBUG_UNLOCK_MUTEX mutex_unlock(&alloc_mutex);
+    uint8_t header[MEMDEBUG_TRACE_BLOCK_HEADER] = {0};
+    trace_put_le(header, len, 4);
+    trace_put_le(header + 4, len, 4);
+    header[16] = MEMDEBUG_TRACE_INDEX;
+    fwrite(header, 1, sizeof(header), trace->file);
+    offset = time = 0;
+    trace_file_varint(trace->num_keyframes);
+    for (size_t i = 0; i < trace->num_keyframes; i++) {
+        trace_file_varint(trace->keyframes[i].offset - offset);
+        trace_file_varint(trace->keyframes[i].time - time);
+        offset = trace->keyframes[i].offset;
+        time = trace->keyframes[i].time;
+    }
 
-struct MemAlloc;
-typedef struct MemAlloc MemAlloc;
-struct MemAlloc {
-    void* ptr;
-    size_t size;
-    size_t line;
-    const char* func;
-    const char* file;
-};
+    uint8_t trailer[16] = {0, 0, 0, 0, 0, 0, 0, 0, 'M', 'D', 'I', 'N', 'D', 'E', 'X', 0};
+    trace_put_le(trailer, trace_totals.file_bytes, 8);
+    fwrite(trailer, 1, sizeof(trailer), trace->file);
+    trace_totals.file_bytes += sizeof(header) + len + sizeof(trailer);
+}
 
-static inline bool
-compare_memallocs(MemAlloc a1, MemAlloc a2) {
-    // First by file
-    int cmp = strcmp(a1.file, a2.file);
-    if (!cmp) {
-        // Then by line
-        return a1.line > a2.line;
-    } else {
-        return (cmp > 0) ? true : false;
+static inline void
+trace_put_event(MemEvent* ev) {
+    uintptr_t low_mask = ((uintptr_t)1 << MEMDEBUG_ALIGN_SHIFT) - 1;
+    uintptr_t ptr = (uintptr_t)ev->ptr, old_ptr = (uintptr_t)ev->old_ptr;
+    uint32_t site = trace_site(ev->site);
+    trace_reserve(MEMDEBUG_TRACE_MAX_EVENT);
+
+    int tag = ev->kind;
+    if (ev->thread != trace->thread)
+        tag |= MEMDEBUG_TRACE_NEW_THREAD;
+    if (ptr & low_mask)
+        tag |= MEMDEBUG_TRACE_PTR_LOW;
+    if (ev->kind == MEMDEBUG_EVENT_REALLOC && (old_ptr & low_mask))
+        tag |= MEMDEBUG_TRACE_OLD_PTR_LOW;
+
+    trace_put_byte((uint8_t)tag);
+    if (tag & MEMDEBUG_TRACE_NEW_THREAD)
+        trace_put_varint(ev->thread);
+    trace_put_zigzag(ev->time - trace->time);
+    trace_put_varint(site);
+    trace_put_zigzag((uint64_t)(ptr >> MEMDEBUG_ALIGN_SHIFT) - (uint64_t)trace->ptr);
+    if (tag & MEMDEBUG_TRACE_PTR_LOW)
+        trace_put_byte((uint8_t)(ptr & low_mask));
+    if (ev->kind == MEMDEBUG_EVENT_REALLOC) {
+        trace_put_zigzag((uint64_t)(old_ptr >> MEMDEBUG_ALIGN_SHIFT) - (uint64_t)(ptr >> MEMDEBUG_ALIGN_SHIFT));
+        if (tag & MEMDEBUG_TRACE_OLD_PTR_LOW)
+            trace_put_byte((uint8_t)(old_ptr & low_mask));
+        trace_put_varint(ev->released && ev->released <= ev->time ? ev->time - ev->released : 0);
     }
+    if (ev->kind != MEMDEBUG_EVENT_FREE)
+        trace_put_varint(ev->size);
+
+    trace->time = ev->time;
+    trace->thread = ev->thread;
+    trace->ptr = ptr >> MEMDEBUG_ALIGN_SHIFT;
 }
 
 static inline void
-sort_memallocs(MemAlloc* allocs, size_t n) {
-    // Sort the buffer. This is a shellsort.
-    size_t interval, i, j;
-    MemAlloc temp;
-    for (interval = n / 2; interval > 0; interval /= 2) {
-        for (i = interval; i < n; i += 1) {
-            temp = allocs[i];
-            for (j = i; j >= interval && compare_memallocs(allocs[j - interval], temp); j -= interval) {
-                allocs[j] = allocs[j - interval];
-            }
-            allocs[j] = temp;
-        }
-    }
+trace_close() {
+    if (!trace)
+        return;
+    event_store(&trace_on, 0);
+    trace_flush();
+    trace_put_index();
+    fclose(trace->file);
+    tracker_pages_free(trace->keyframes, sizeof(TraceIndexEntry) * trace->keyframes_capacity);
+    tracker_pages_free(trace->sites, trace->sites_capacity);
+    tracker_pages_free(trace->strings, sizeof(TraceString) * trace->strings_capacity);
+    tracker_pages_free(trace, sizeof(TraceWriter));
+    trace = NULL;
 }
+#endif
 
-struct MapMember;
-typedef struct MapMember MapMember;
-struct MapMember {
-    MemAlloc alloc;
-    MapMember* next;
-};
+// Format an event like printf() would, returning the length it needed.
+static inline int
+event_format(char* buf, size_t cap, MemEvent* ev) {
+    CallSite* site = ev->site;
+    if (ev->kind == MEMDEBUG_EVENT_MALLOC) {
+        return snprintf(buf, cap,
+                        ANSI_COLOR_FUNC "malloc(" ANSI_COLOR_RESET
+                            ANSI_COLOR_BYTE "%zu" ANSI_COLOR_RESET
+                                ANSI_COLOR_FUNC ")" ANSI_COLOR_RESET
+                                        " -> " ANSI_COLOR_PNTR "%p" ANSI_COLOR_RESET
+                                        " on line " ANSI_COLOR_LINE "%zu" ANSI_COLOR_RESET
+                                        " of " ANSI_COLOR_FUNC "%s()" ANSI_COLOR_RESET
+                                        " in " ANSI_COLOR_FILE "%s" ANSI_COLOR_RESET
+                                        ".\n",
+                        ev->size, ev->ptr, site->line, site->func, site->file);
+    } else if (ev->kind == MEMDEBUG_EVENT_REALLOC) {
+        return snprintf(buf, cap,
+                        ANSI_COLOR_FUNC "realloc(" ANSI_COLOR_RESET
+                            ANSI_COLOR_PNTR "%p" ANSI_COLOR_RESET
+                                ANSI_COLOR_FUNC ", " ANSI_COLOR_RESET
+                                    ANSI_COLOR_BYTE "%zu" ANSI_COLOR_RESET
+                                        ANSI_COLOR_FUNC ")" ANSI_COLOR_RESET
+                                        " -> " ANSI_COLOR_PNTR "%p" ANSI_COLOR_RESET
+                                        " on line " ANSI_COLOR_LINE "%zu" ANSI_COLOR_RESET
+                                        " of " ANSI_COLOR_FUNC "%s()" ANSI_COLOR_RESET
+                                        " in " ANSI_COLOR_FUNC "%s" ANSI_COLOR_RESET
+                                        ".\n",
+                        ev->old_ptr, ev->size, ev->ptr, site->line, site->func, site->file);
+    } else {
+        return snprintf(buf, cap,
+                        ANSI_COLOR_FUNC "free(" ANSI_COLOR_RESET
+                            ANSI_COLOR_PNTR "%p" ANSI_COLOR_RESET
+                                ANSI_COLOR_FUNC ")" ANSI_COLOR_RESET
+                                        " on line " ANSI_COLOR_LINE "%zu" ANSI_COLOR_RESET
+                                        " of " ANSI_COLOR_FUNC "%s()" ANSI_COLOR_RESET
+                                        " in " ANSI_COLOR_FILE "%s" ANSI_COLOR_RESET
+                                        ".\n",
+                        ev->ptr, site->line, site->func, site->file);
+    }
+}
 
-// Global alloc hash map
-static MapMember allocs[MAP_BUF_SIZE];
-static bool memallocs_initialized = false;
-static size_t num_allocs = 0;
+// Add an event to event_text, writing the text out first if it's full. Needs event_mutex.
+static inline size_t
+event_append(size_t used, MemEvent* ev) {
+    int len = event_format(event_text + used, sizeof(event_text) - used, ev);
+    if (len >= 0 && (size_t)len >= sizeof(event_text) - used) {
+        fwrite(event_text, 1, used, stdout);
+        used = 0;
+        len = event_format(event_text, sizeof(event_text), ev);
+        if ((size_t)len >= sizeof(event_text))
+            len = sizeof(event_text) - 1;
+    }
+    return len > 0 ? used + (size_t)len : used;
+}
 
-/***************/
-/* Map Methods */
-/***************/
-static inline void OOM(size_t line, const char* func, const char* file, size_t num_bytes);
+// Write an event out, returning how much of event_text is used. Needs event_mutex.
+static inline size_t
+event_emit(size_t used, MemEvent* ev) {
+#if PRINT_MEMALLOCS
+    used = event_append(used, ev);
+#endif
+#if MEMDEBUG_TRACE
+    if (ev->traced && trace)
+        trace_put_event(ev);
+#endif
+    return used;
+}
 
+// Write out every ring's pending events. Needs event_mutex.
 static inline void
-memallocs_init() {
-    for (size_t i = 0; i < MAP_BUF_SIZE; i++) {
-        allocs[i].alloc.ptr = NULL;
-        allocs[i].next = NULL;
+events_write() {
+    size_t used = 0;
+    for (EventRing* ring = (EventRing*)event_load(&event_rings); ring; ring = ring->next) {
+        size_t read = ring->read;
+        size_t write = event_load(&ring->write);
+        for (; read != write; read++)
+            used = event_emit(used, &ring->events[read & (MEMDEBUG_EVENT_RING - 1)]);
+        event_store(&ring->read, read);
+    }
+    if (used) {
+        fwrite(event_text, 1, used, stdout);
+        fflush(stdout);
     }
-    memallocs_initialized = true;
 }
 
 static inline void
-alloc_add(MemAlloc alloc) {
-    if (!memallocs_initialized)
-        memallocs_init();
+events_drain() {
+    mutex_lock(&event_mutex);
+    events_write();
+    mutex_unlock(&event_mutex);
+}
 
-    num_allocs++;
+// events_drain() for the out of memory report, which can't wait for a lock.
+static inline void
+events_drain_nowait() {
+    if (mutex_trylock(&event_mutex))
+        return;
+    events_write();
+    mutex_unlock(&event_mutex);
+}
 
-    // Travel to the bucket to put this allocation into.
-    MapMember* bucket = (MapMember*)allocs + ptr_hash(alloc.ptr);
+// Drain what can be drained before OOM() or mempanic() exits. The failing thread may hold
+// event_mutex itself, or a shard or log lock the writer thread is waiting on with it held, so
+// neither this nor events_exit() may block on it.
+static inline void
+events_fail() {
+    event_store(&events_failed, 1);
+    events_drain_nowait();
+}
 
-    // If we can insert into the bucket directly, do so.
-    if (bucket->alloc.ptr == NULL) {
-        bucket->alloc = alloc;
+#if MEMDEBUG_TRACE
+// Record every live allocation in the trace. Needs event_mutex. If a heap snapshot is being
+// read, this waits for the writer thread to try again, since the reader could be waiting to
+// drain its ring. This takes every log and shard lock with event_mutex held, so a thread that
+// runs out of memory holding one of them must never wait on event_mutex: OOM() and mempanic()
+// only try it, and once they have been called no keyframe is started.
+static inline void
+trace_keyframe() {
+    if (event_load(&events_failed) || mutex_trylock(&heap_snapshot_mutex)) {
+        trace->keyframe_due = true;
         return;
     }
 
-    // Otherwise, traverse the linked list until you find the end
-    while (bucket->next != NULL) {
-        bucket = bucket->next;
+    // Everything written before the keyframe happened before its time.
+    events_write();
+    uint64_t now = clock_ns();
+    heap_snapshot_take();
+
+    trace->time = now;
+    trace_flush();
+    trace->block_flags = MEMDEBUG_TRACE_KEYFRAME_BLOCK;
+    trace_forget_names();
+    trace_add_keyframe(trace_totals.file_bytes, now - trace->start);
+    trace_reserve(1 + 10);
+    trace_put_byte(MEMDEBUG_TRACE_KEYFRAME);
+    trace_put_varint(now - trace->start);
+
+    // A group at a time: the sites it needs, then its allocations.
+    uintptr_t low_mask = ((uintptr_t)1 << MEMDEBUG_ALIGN_SHIFT) - 1;
+    MemAlloc group[MEMDEBUG_GROUP_WIDTH];
+    size_t cursor[2], n, count = 0;
+    heap_snapshot_cursor(cursor);
+    while ((n = heap_snapshot_read(cursor, group))) {
+        for (size_t i = 0; i < n; i++)
+            trace_site(site_get(group[i].site));
+        trace_reserve(1 + 10 + MEMDEBUG_GROUP_WIDTH * 31);
+        trace_put_byte(MEMDEBUG_TRACE_LIVE);
+        trace_put_varint(n);
+        for (size_t i = 0; i < n; i++) {
+            uintptr_t ptr = (uintptr_t)memalloc_ptr(&group[i]);
+            trace_put_varint((uint64_t)group[i].site << 1 | ((ptr & low_mask) != 0));
+            trace_put_zigzag((uint64_t)(ptr >> MEMDEBUG_ALIGN_SHIFT) - (uint64_t)trace->ptr);
+            if (ptr & low_mask)
+                trace_put_byte((uint8_t)(ptr & low_mask));
+            trace_put_varint(memalloc_size(&group[i]));
+            trace->ptr = ptr >> MEMDEBUG_ALIGN_SHIFT;
+        }
+        count += n;
     }
+    heap_snapshot_end();
 
-    // Create a new LL node off the previous for the allocation
-    bucket->next = (MapMember*)malloc(sizeof(MapMember));
-    if (!bucket->next) OOM(__LINE__ - 1, __func__, __FILE__, sizeof(MapMember));
-    bucket = bucket->next;
+    trace_reserve(1 + 10);
+    trace_put_byte(MEMDEBUG_TRACE_KEYFRAME_END);
+    trace_put_varint(count);
+    trace->keyframed = clock_ns();
+    trace->keyframe_due = false;
+}
+#endif
 
-    // Put the allocation into it.
-    bucket->alloc = alloc;
-    bucket->next = NULL;
+static THREAD_FN(events_writer_loop, ctx) {
+    (void)ctx;
+    for (;;) {
+        thread_sleep_ms(MEMDEBUG_EVENT_FLUSH_MS);
+        mutex_lock(&event_mutex);
+        size_t done = events_done;
+        // After OOM() or mempanic(), what's left is written at exit if the lock can be had then.
+        if (!done && !event_load(&events_failed)) {
+            events_write();
+#if MEMDEBUG_TRACE
+            if (trace && (trace->keyframe_due || clock_ns() - trace->keyframed >= (uint64_t)MEMDEBUG_TRACE_KEYFRAME_MS * 1000000))
+                trace_keyframe();
+            if (trace && clock_ns() - trace->flushed >= (uint64_t)MEMDEBUG_TRACE_FLUSH_MS * 1000000) {
+                trace_flush();
+                fflush(trace->file);
+            }
+#endif
+        }
+        mutex_unlock(&event_mutex);
+        if (done)
+            return 0;
+    }
 }
 
-// returns the pointer, or NULL if not found.
-static inline bool
-alloc_remove(void* ptr) {
-    if (!memallocs_initialized) {
-        memallocs_init();
-        return false;
+static void
+events_exit(void) {
+    if (!event_load(&events_failed)) {
+        mutex_lock(&event_mutex);
+    } else {
+        // Give a writer that's only busy a moment to finish, then leave the trace cut short.
+        int tries = 0;
+        while (mutex_trylock(&event_mutex)) {
+            if (++tries == 100)
+                return;
+            thread_sleep_ms(1);
+        }
     }
+    events_write();
+#if MEMDEBUG_TRACE
+    trace_close();
+#endif
+    event_store(&events_done, 1);
+    mutex_unlock(&event_mutex);
+}
 
-    MapMember* previous = NULL;
-    MapMember* bucket = (MapMember*)allocs + ptr_hash(ptr);
-
-    // Traverse the bucket looking for the pointer
-    while (bucket) {
-        if (bucket->alloc.ptr == ptr) {
-            // Remove this bucket node from the linked list
-            if (!previous) {
-                // Copy from the next node into the original array.
-                if (bucket->next) {
-                    MapMember* to_free = bucket->next;
-                    bucket->alloc = to_free->alloc;
-                    bucket->next = to_free->next;
-                    free(to_free);
-                } else {
-                    bucket->alloc.ptr = NULL;
-                    bucket->next = NULL;
-                }
-            } else {
-                // Point the previous allocation at the next allocation.
-                // Then free the bucket.
-                previous->next = bucket->next;
-                free(bucket);
-            }
-            num_allocs--;
-            return true;
-        } else {
-            previous = bucket;
-            bucket = bucket->next;
+static void
+event_ring_exit(void* ctx) {
+    mutex_lock(&event_rings_mutex);
+    ((EventRing*)ctx)->in_use = false;
+    mutex_unlock(&event_rings_mutex);
+}
+
+static void
+events_init(void) {
+    tls_key_create(&event_ring_key, event_ring_exit);
+    atexit(events_exit);
+    // Without a writer thread, events are written out when a ring fills up or a report is printed.
+    thread_t writer;
+    if (!thread_create(&writer, events_writer_loop, NULL))
+        thread_detach(writer);
+}
+
+static inline EventRing*
+event_ring_get() {
+    if (event_ring)
+        return event_ring;
+    once_run(&events_once, events_init);
+
+    // Take over the ring of a thread that has exited, or make a new one.
+    mutex_lock(&event_rings_mutex);
+    for (EventRing* ring = event_rings; ring; ring = ring->next) {
+        if (!ring->in_use) {
+            ring->in_use = true;
+            event_ring = ring;
+            break;
         }
     }
+    if (!event_ring) {
+        EventRing* ring = (EventRing*)slab_alloc(&event_ring_slab);
+        if (!ring) OOM(__LINE__ - 1, __func__, __FILE__, sizeof(EventRing));
+        ring->events = (MemEvent*)tracker_pages_alloc(sizeof(MemEvent) * MEMDEBUG_EVENT_RING);
+        if (!ring->events) OOM(__LINE__ - 1, __func__, __FILE__, sizeof(MemEvent) * MEMDEBUG_EVENT_RING);
+        ring->in_use = true;
+        ring->next = event_rings;
+        event_store(&event_rings, ring);
+        event_ring = ring;
+    }
+    mutex_unlock(&event_rings_mutex);
 
-    return false;
+    tls_set(event_ring_key, event_ring);
+    return event_ring;
+}
+
+static inline void
+memdebug_event(int kind, void* ptr, void* old_ptr, uint64_t released, size_t size, CallSite* site) {
+#if MEMDEBUG_TRACE
+    bool traced = event_load(&trace_on) != 0;
+#else
+    bool traced = false;
+#endif
+    if (!PRINT_MEMALLOCS && !traced)
+        return;
+
+    MemEvent ev;
+    ev.kind = kind;
+    ev.traced = traced;
+#if MEMDEBUG_TRACE
+    ev.thread = traced ? event_thread_id() : 0;
+    ev.time = traced ? clock_ns() : 0;
+#endif
+    ev.released = released;
+    ev.ptr = ptr;
+    ev.old_ptr = old_ptr;
+    ev.size = size;
+    ev.site = site;
+
+    if (!MEMDEBUG_ASYNC_PRINT || event_load(&events_done)) {
+        mutex_lock(&event_mutex);
+        events_write();
+        size_t used = event_emit(0, &ev);
+        if (used) {
+            fwrite(event_text, 1, used, stdout);
+            fflush(stdout);
+        }
+        mutex_unlock(&event_mutex);
+        return;
+    }
+
+    EventRing* ring = event_ring_get();
+    if (ring->write - event_load(&ring->read) == MEMDEBUG_EVENT_RING)
+        events_drain();
+    ring->events[ring->write & (MEMDEBUG_EVENT_RING - 1)] = ev;
+    event_store(&ring->write, ring->write + 1);
+}
+
+// In a forked child, the pending events are the parent's to write out, and there's no writer thread.
+static inline void
+events_forget() {
+    for (EventRing* ring = event_rings; ring; ring = ring->next)
+        ring->read = ring->write;
+    events_done = 1;
+#if MEMDEBUG_TRACE
+    trace_on = 0;
+    trace = NULL;
+#endif
+}
+
+#else  // MEMDEBUG_EVENTS
+static inline void events_drain() {}
+static inline void events_drain_nowait() {}
+static inline void events_fail() {}
+static inline void events_forget() {}
+#endif
+
+#if MEMDEBUG_TRACE
+// Start recording every malloc(), realloc() and free() to a new trace at path. Returns 0 on
+// success, or 1 if the file can't be opened, there's no memory to write it with, or a trace
+// is already being recorded.
+int memdebug_trace_start(const char* path) {
+    once_run(&events_once, events_init);
+    mutex_lock(&event_mutex);
+    TraceWriter* writer = trace || events_done ? NULL : (TraceWriter*)tracker_pages_alloc(sizeof(TraceWriter));
+    FILE* file = writer ? fopen(path, "wb") : NULL;
+    if (!file) {
+        tracker_pages_free(writer, sizeof(TraceWriter));
+        mutex_unlock(&event_mutex);
+        return 1;
+    }
+    trace = writer;
+    trace->file = file;
+    trace->start = trace->time = clock_ns();
+    trace_totals.raw_bytes = trace_totals.compress_ns = 0;
+    trace_flush();
+
+    // The start time doesn't need to be kept, since events are timed from it.
+    const char header[10] = {'M', 'D', 'T', 'R', 'A', 'C', 'E', 0, MEMDEBUG_TRACE_VERSION, MEMDEBUG_ALIGN_SHIFT};
+    fwrite(header, 1, sizeof(header), file);
+    trace_totals.file_bytes = sizeof(header);
+
+    // Trace from before the first keyframe, which the writer thread retries if it has to.
+    event_store(&trace_on, 1);
+    trace_keyframe();
+    mutex_unlock(&event_mutex);
+    return 0;
+}
+
+// Stop recording, and write out and close the trace. Events that race with this may be left out.
+void memdebug_trace_stop() {
+    mutex_lock(&event_mutex);
+    event_store(&trace_on, 0);
+    events_write();
+    trace_close();
+    mutex_unlock(&event_mutex);
 }
+#else
+int memdebug_trace_start(const char* path) { (void)path; return 1; }
+void memdebug_trace_stop() {}
+#endif
 
 /****************/
 /* Memory Panic */
@@ -295,6 +3401,8 @@ alloc_remove(void* ptr) {
 
 static inline void
 mempanic(void* badptr, const char* message, size_t line, const char* func, const char* file) {
+    oom_reserve_release();
+    events_fail();
     printf(ANSI_COLOR_PNIC "\nMEMORY PANIC: %s\n" ANSI_COLOR_RESET
                ANSI_COLOR_PNTR "Pointer: %p\n" ANSI_COLOR_RESET
                    ANSI_COLOR_LINE "On line: %zu\n" ANSI_COLOR_RESET
@@ -308,6 +3416,8 @@ mempanic(void* badptr, const char* message, size_t line, const char* func, const
 
 static inline void
 OOM(size_t line, const char* func, const char* file, size_t num_bytes) {
+    oom_reserve_release();
+    events_fail();
     if (strcmp(file, "memdebug.h") == 0) {
         printf(ANSI_COLOR_PNIC
                "\nIronically, this program has run out of memory keeping track of or printing memory allocations."
@@ -354,12 +3464,13 @@ print_alloc_summary(size_t total_ptrs_at_location, size_t total_bytes_at_locatio
 }
 
 static inline void
-print_heap_summary_totals(size_t total_allocated, size_t num_allocs) {
+print_heap_summary_totals(size_t total_allocated, size_t num_allocs, size_t tracker_bytes) {
     printf(
         "\nTotal Heap size in bytes: %zu"
         "\nTotal number of heap allocations: %zu"
+        "\nMemory used by memdebug itself in bytes: %zu"
         "\n\n\n",
-        total_allocated, num_allocs);
+        total_allocated, num_allocs, tracker_bytes);
     fflush(stdout);
 }
 
@@ -368,242 +3479,600 @@ print_heap_dump_header() {
     printf(ANSI_COLOR_HEAD "\n*************\n* HEAP DUMP *\n*************\n" ANSI_COLOR_RESET);
 }
 
+/*
+ * print_heap_fork() takes every lock memdebug has before it forks, in the order they nest,
+ * so the child can't inherit one that another thread was halfway through. The child is the
+ * only thread on its side, and it reports from its copy on write image of the tables.
+ * heap_snapshot_mutex comes first: a memdebug_iter_begin() caller holds it while its own code
+ * runs, and that code can print, or drain a full event ring and so take event_mutex.
+ */
+#ifndef _WIN32
+static size_t heap_dumps_forked = 0;  // Guarded by tracker_mutex, for naming reports
+
+static inline void
+fork_lock_all() {
+    mutex_lock(&heap_snapshot_mutex);
+#if MEMDEBUG_EVENTS
+    mutex_lock(&event_mutex);
+#endif
+    flockfile(stdout);
+    thread_logs_lock();
+    alloc_lock_all();
+    mutex_lock(&site_mutex);
+    mutex_lock(&tracker_mutex);
+}
+
+static inline void
+fork_unlock_all() {
+    mutex_unlock(&tracker_mutex);
+    mutex_unlock(&site_mutex);
+    alloc_unlock_all();
+    thread_logs_unlock();
+    funlockfile(stdout);
+#if MEMDEBUG_EVENTS
+    mutex_unlock(&event_mutex);
+#endif
+    mutex_unlock(&heap_snapshot_mutex);
+}
+#endif
+
+/*
+ * print_heap_exact() can split its snapshot scan between heap_scan_threads threads. Each one
+ * counts the allocations in its slice of every table by call site, and the counts are added
+ * up at the end.
+ */
+#ifndef MEMDEBUG_SCAN_THREADS
+#define MEMDEBUG_SCAN_THREADS 1
+#endif
+#define MEMDEBUG_MAX_SCAN_THREADS 64
+#if MEMDEBUG_SCAN_THREADS < 1 || MEMDEBUG_SCAN_THREADS > MEMDEBUG_MAX_SCAN_THREADS
+#error "MEMDEBUG_SCAN_THREADS must be between 1 and 64."
+#endif
+
+static size_t heap_scan_threads = MEMDEBUG_SCAN_THREADS;
+
+struct SiteTotals;
+typedef struct SiteTotals SiteTotals;
+struct SiteTotals {
+    size_t part;
+    size_t parts;
+    size_t num_sites;
+    size_t* counts;  // Indexed by site id
+    size_t* bytes;
+};
+
+static void
+site_totals_visit(MemAlloc* alloc, void* ctx) {
+    SiteTotals* totals = (SiteTotals*)ctx;
+    // Sites registered after the report started aren't in it.
+    if (alloc->site >= totals->num_sites)
+        return;
+    totals->counts[alloc->site]++;
+    totals->bytes[alloc->site] += memalloc_size(alloc);
+}
+
+static THREAD_FN(site_totals_worker, ctx) {
+    SiteTotals* totals = (SiteTotals*)ctx;
+    heap_snapshot_for_each_part(totals->part, totals->parts, site_totals_visit, totals);
+    return 0;
+}
+
+struct SiteRank;
+typedef struct SiteRank SiteRank;
+struct SiteRank {
+    size_t key;
+    CallSite* site;
+    size_t live_count;
+    size_t live_bytes;
+};
+
+// Restore the min heap property below ranks[i].
+static inline void
+site_rank_sift_down(SiteRank* ranks, size_t n, size_t i) {
+    for (;;) {
+        size_t smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < n && ranks[left].key < ranks[smallest].key)
+            smallest = left;
+        if (right < n && ranks[right].key < ranks[smallest].key)
+            smallest = right;
+        if (smallest == i)
+            return;
+        SiteRank temp = ranks[i];
+        ranks[i] = ranks[smallest];
+        ranks[smallest] = temp;
+        i = smallest;
+    }
+}
+
+// Rank the call sites with live allocations by order_by into the k entries of ranks, biggest
+// first, and add every site's live counts to the totals. Returns how many were ranked.
+static inline size_t
+site_rank_top(SiteRank* ranks, size_t k, MemdebugOrder order_by, size_t num_sites, size_t* total_allocated, size_t* num_allocs) {
+    size_t ranked = 0;
+    for (size_t id = 0; id < num_sites; id++) {
+        CallSite* site = site_get((uint32_t)id);
+        SiteRank rank;
+        rank.site = site;
+        rank.live_count = site_counter_load(&site->live_count);
+        rank.live_bytes = site_counter_load(&site->live_bytes);
+        if (!rank.live_count)
+            continue;
+        *total_allocated += rank.live_bytes;
+        *num_allocs += rank.live_count;
+
+        if (order_by == MEMDEBUG_BY_COUNT)
+            rank.key = rank.live_count;
+        else if (order_by == MEMDEBUG_BY_AVERAGE_SIZE)
+            rank.key = rank.live_bytes / rank.live_count;
+        else
+            rank.key = rank.live_bytes;
+
+        // Keep the k biggest, with the smallest of them on top.
+        if (ranked < k) {
+            size_t i = ranked++;
+            for (; i > 0 && ranks[(i - 1) / 2].key > rank.key; i = (i - 1) / 2)
+                ranks[i] = ranks[(i - 1) / 2];
+            ranks[i] = rank;
+        } else if (k && rank.key > ranks[0].key) {
+            ranks[0] = rank;
+            site_rank_sift_down(ranks, ranked, 0);
+        }
+    }
+
+    // Pop the smallest to the back until the heap is empty, which leaves them biggest first.
+    for (size_t n = ranked; n > 1; n--) {
+        SiteRank temp = ranks[0];
+        ranks[0] = ranks[n - 1];
+        ranks[n - 1] = temp;
+        site_rank_sift_down(ranks, n - 1, 0);
+    }
+    return ranked;
+}
+
+/*
+ * When the program runs out of memory, low_mem_print_heap() reports the MEMDEBUG_OOM_SITES
+ * call sites with the most live bytes, ranked in a table reserved up front, from the per-site
+ * counters. It allocates nothing and waits on no lock, since the thread that ran out may be
+ * holding one. Set MEMDEBUG_OOM_PRINT_POINTERS to 1 to list every live pointer after it.
+ */
+#ifndef MEMDEBUG_OOM_SITES
+#define MEMDEBUG_OOM_SITES 32
+#endif
+#ifndef MEMDEBUG_OOM_PRINT_POINTERS
+#define MEMDEBUG_OOM_PRINT_POINTERS 0
+#endif
+
+static SiteRank oom_ranks[MEMDEBUG_OOM_SITES];
+static mutex_t oom_mutex = MUTEX_INITIALIZER;  // Guards oom_ranks. A second thread to run out waits for the first to exit.
+
+#if MEMDEBUG_OOM_PRINT_POINTERS
+static void
+low_mem_print_visit(MemAlloc* alloc, void* ctx) {
+    (void)ctx;
+    const CallSite* site = site_get(alloc->site);
+    printf(
+        ANSI_COLOR_PNTR "Heap ptr: %p" ANSI_COLOR_RESET
+            ANSI_COLOR_BYTE " of size: %zu" ANSI_COLOR_RESET
+                ANSI_COLOR_FILE " Allocated in file: %s" ANSI_COLOR_RESET
+                    ANSI_COLOR_LINE " On line: %zu\n" ANSI_COLOR_RESET,
+        memalloc_ptr(alloc), memalloc_size(alloc), site->file, site->line);
+}
+#endif
+
 /**********************/
 /* Externally Visible */
 /**********************/
 
-// Print all of the memory allocations of this program.
+// Print how much each call site has allocated and not freed yet, by file and line. This only
+// reads the per-site counters, so it costs the same however many allocations are live.
 void print_heap() {
+    events_drain();
     size_t total_allocated = 0;
-    size_t allocs_idx = 0;
-    MemAlloc* all_allocs = (MemAlloc*)malloc(sizeof(MemAlloc) * num_allocs);
-    if (!all_allocs) OOM(__LINE__ - 1, __func__, __FILE__, sizeof(MemAlloc) * num_allocs);
-
-    MEMDEBUG_LOCK_MUTEX;
-    if (!memallocs_initialized)
-        memallocs_init();
-
-    // Pack the buffer
-    for (size_t i = 0; i < MAP_BUF_SIZE; i++) {
-        MapMember* bucket = (MapMember*)(allocs + i);
-        while (bucket->alloc.ptr != NULL) {
-            all_allocs[allocs_idx++] = bucket->alloc;
-            total_allocated += bucket->alloc.size;
-            if (bucket->next) {
-                bucket = bucket->next;
-            } else {
-                break;
-            }
-        }
+    size_t num_allocs = 0;
+    size_t num_sites = site_num();
+    CallSite** order = site_order(num_sites);
+
+    print_heap_dump_header();
+    for (size_t i = 0; i < num_sites; i++) {
+        CallSite* site = order[i];
+        size_t live_count = site_counter_load(&site->live_count);
+        size_t live_bytes = site_counter_load(&site->live_bytes);
+        if (!live_count)
+            continue;
+        print_alloc_summary(live_count, live_bytes, (char*)site->file, (char*)site->func, site->line);
+        total_allocated += live_bytes;
+        num_allocs += live_count;
     }
-    MEMDEBUG_UNLOCK_MUTEX;
 
-    // Sort the buffer
-    sort_memallocs(all_allocs, allocs_idx);
+    print_heap_summary_totals(total_allocated, num_allocs, tracker_memory());
+    tracker_pages_free(order, sizeof(CallSite*) * num_sites);
+}
 
-    // Print the formatted results
-    print_heap_dump_header();
-    if (allocs_idx) {
-        char* location_file = NULL;
-        char* location_func;
-        size_t location_line;
+// Print the k call sites with the most live bytes, live allocations, or the largest average
+// live allocation. The sites are picked with a min heap of k entries as the per-site counters
+// are read, so this never looks at individual allocations.
+void print_heap_top(size_t k, MemdebugOrder order_by) {
+    static const char* order_names[] = {"live bytes", "live allocations", "average allocation size"};
+    events_drain();
+    size_t total_allocated = 0;
+    size_t num_allocs = 0;
+    size_t num_sites = site_num();
+    if (k > num_sites)
+        k = num_sites;
+
+    SiteRank* ranks = NULL;
+    if (k) {
+        ranks = (SiteRank*)tracker_pages_alloc(sizeof(SiteRank) * k);
+        if (!ranks) OOM(__LINE__ - 1, __func__, __FILE__, sizeof(SiteRank) * k);
+    }
+    size_t ranked = site_rank_top(ranks, k, order_by, num_sites, &total_allocated, &num_allocs);
 
-        size_t total_bytes_at_location;
-        size_t total_ptrs_at_location;
+    print_heap_dump_header();
+    printf("Top %zu call sites by %s:\n", ranked, order_names[order_by <= MEMDEBUG_BY_AVERAGE_SIZE ? order_by : 0]);
+    for (size_t i = 0; i < ranked; i++) {
+        CallSite* site = ranks[i].site;
+        print_alloc_summary(ranks[i].live_count, ranks[i].live_bytes, (char*)site->file, (char*)site->func, site->line);
+    }
+    print_heap_summary_totals(total_allocated, num_allocs, tracker_memory());
 
-        for (size_t i = 0; i < allocs_idx; i++) {
-            MemAlloc alloc = all_allocs[i];
+    tracker_pages_free(ranks, sizeof(SiteRank) * k);
+}
 
-            // If the current allocation is not the same as the last, print the summary of that location in the code.
-            if ((alloc.line != location_line) || (alloc.func != location_func) || (alloc.file != location_file)) {
-                if (location_file != NULL) {
-                    print_alloc_summary(total_ptrs_at_location, total_bytes_at_location, location_file, location_func, location_line);
-                }
+// The same report as print_heap(), but counted from every live allocation in the table
+// instead of read from the per-site counters. Not while this thread walks the heap, as
+// memdebug_iter_begin() explains.
+void print_heap_exact() {
+    if (heap_walk) {
+        printf(ANSI_COLOR_PNIC "print_heap_exact() can't run while this thread walks the heap.\n" ANSI_COLOR_RESET);
+        return;
+    }
+    events_drain();
+
+    // The snapshot is taken after this and freed before it, so memory from the OOM reserve is reused.
+    size_t num_sites = site_num();
+    size_t parts = heap_scan_threads;
+    size_t* buffer = NULL;
+    if (num_sites) {
+        buffer = (size_t*)tracker_pages_alloc(sizeof(size_t) * 2 * num_sites * parts);
+        if (!buffer) OOM(__LINE__ - 1, __func__, __FILE__, sizeof(size_t) * 2 * num_sites * parts);
+    }
+    heap_snapshot_begin();
+
+    SiteTotals totals[MEMDEBUG_MAX_SCAN_THREADS];
+    for (size_t p = 0; p < parts; p++) {
+        totals[p].part = p;
+        totals[p].parts = parts;
+        totals[p].num_sites = num_sites;
+        totals[p].counts = buffer + 2 * num_sites * p;
+        totals[p].bytes = buffer + 2 * num_sites * p + num_sites;
+    }
 
-                location_file = (char*)alloc.file;
-                location_func = (char*)alloc.func;
-                location_line = alloc.line;
-                total_bytes_at_location = alloc.size;
-                total_ptrs_at_location = 1;
-            } else {
-                total_bytes_at_location += alloc.size;
-                total_ptrs_at_location++;
-            }
+    // This thread scans the first slice. A slice whose thread can't be started is scanned here too.
+    thread_t workers[MEMDEBUG_MAX_SCAN_THREADS];
+    size_t started = 1;
+    while (started < parts && !thread_create(&workers[started], site_totals_worker, &totals[started]))
+        started++;
+    site_totals_worker(&totals[0]);
+    for (size_t p = started; p < parts; p++)
+        site_totals_worker(&totals[p]);
+    for (size_t p = 1; p < started; p++)
+        thread_join(workers[p]);
+    heap_snapshot_end();
+
+    for (size_t p = 1; p < parts; p++) {
+        for (size_t id = 0; id < num_sites; id++) {
+            totals[0].counts[id] += totals[p].counts[id];
+            totals[0].bytes[id] += totals[p].bytes[id];
         }
+    }
 
-        print_alloc_summary(total_ptrs_at_location, total_bytes_at_location, location_file, location_func, location_line);
+    // Print the formatted results, by file and line
+    size_t total_allocated = 0;
+    size_t num_allocs = 0;
+    CallSite** order = site_order(num_sites);
+    print_heap_dump_header();
+    for (size_t i = 0; i < num_sites; i++) {
+        CallSite* site = order[i];
+        uint32_t id = site_id(site);
+        if (!totals[0].counts[id])
+            continue;
+        print_alloc_summary(totals[0].counts[id], totals[0].bytes[id], (char*)site->file, (char*)site->func, site->line);
+        total_allocated += totals[0].bytes[id];
+        num_allocs += totals[0].counts[id];
     }
+    print_heap_summary_totals(total_allocated, num_allocs, tracker_memory());
 
-    print_heap_summary_totals(total_allocated, num_allocs);
+    tracker_pages_free(order, sizeof(CallSite*) * num_sites);
+    tracker_pages_free(buffer, sizeof(size_t) * 2 * num_sites * parts);
+}
 
-    free(all_allocs);
+// How many threads print_heap_exact() splits its scan between, from 1 to 64.
+void set_heap_scan_threads(size_t num_threads) {
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > MEMDEBUG_MAX_SCAN_THREADS)
+        num_threads = MEMDEBUG_MAX_SCAN_THREADS;
+    heap_scan_threads = num_threads;
 }
 
-// This is the same as print_heap() except it doesn't sort
-// because it's meant to be called when the program is out of memory.
-void low_mem_print_heap() {
-    size_t total_allocated = 0;
+// Write print_heap_exact()'s report to path from a forked child, and return as soon as it has
+// been forked. The parent only waits for the fork itself, which copies the page tables. With a
+// NULL path the report goes to memdebug-heap-<pid>-<n>.txt in the working directory. Returns 0
+// on success, with dump describing the child, or nonzero if no child could be started or this
+// thread is walking the heap.
+int print_heap_fork(const char* path, MemdebugDump* dump) {
+    memset(dump, 0, sizeof(MemdebugDump));
+#ifdef _WIN32
+    (void)path;
+    dump->status = -1;
+    return 1;
+#else
+    if (heap_walk || (path && strlen(path) >= sizeof(dump->path))) {
+        dump->status = -1;
+        return 1;
+    }
 
-    MEMDEBUG_LOCK_MUTEX;
+    // Anything buffered now would be written by both processes.
+    events_drain();
+    fflush(stdout);
+    fork_lock_all();
+    if (path)
+        strcpy(dump->path, path);
+    else
+        snprintf(dump->path, sizeof(dump->path), "memdebug-heap-%ld-%zu.txt", (long)getpid(), heap_dumps_forked++);
+    pid_t pid = fork();
+    fork_unlock_all();
+
+    if (pid == 0) {
+        events_forget();
+        int fd = open(dump->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0)
+            _exit(1);
+        print_heap_exact();
+        _exit(fflush(stdout) ? 1 : 0);
+    }
+    if (pid < 0) {
+        dump->status = -1;
+        return 1;
+    }
+    dump->pid = (long)pid;
+    return 0;
+#endif
+}
 
-    if (!memallocs_initialized)
-        memallocs_init();
+static inline int
+heap_dump_reap(MemdebugDump* dump, int options) {
+#ifdef _WIN32
+    (void)options;
+#else
+    if (dump->pid) {
+        int wstatus;
+        pid_t pid = waitpid((pid_t)dump->pid, &wstatus, options);
+        if (pid == 0)
+            return 0;
+        dump->status = pid > 0 && WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0 ? 1 : -1;
+        dump->pid = 0;
+    }
+#endif
+    return dump->status;
+}
 
-    // For each bucket, traverse over each and print all the allocations
-    print_heap_dump_header();
-    for (size_t i = 0; i < MAP_BUF_SIZE; i++) {
-        MapMember* bucket = (MapMember*)(allocs + i);
-        while (bucket->alloc.ptr != NULL) {
-            MemAlloc alloc = bucket->alloc;
-            printf(
-                ANSI_COLOR_PNTR "Heap ptr: %p" ANSI_COLOR_RESET
-                    ANSI_COLOR_BYTE " of size: %zu" ANSI_COLOR_RESET
-                        ANSI_COLOR_FILE " Allocated in file: %s" ANSI_COLOR_RESET
-                            ANSI_COLOR_LINE " On line: %zu\n" ANSI_COLOR_RESET,
-                alloc.ptr, alloc.size, alloc.file, alloc.line);
-            total_allocated += alloc.size;
-
-            if (bucket->next) {
-                bucket = bucket->next;
-            } else {
-                break;
-            }
+// Check on a report from print_heap_fork() without blocking. Returns 0 while it's still being
+// written, 1 once it's in dump->path, or -1 if the child failed.
+int heap_dump_poll(MemdebugDump* dump) {
+#ifdef _WIN32
+    return heap_dump_reap(dump, 0);
+#else
+    return heap_dump_reap(dump, WNOHANG);
+#endif
+}
+
+// Wait for a report from print_heap_fork() to be written. Returns 1 if it was, or -1 if not.
+int heap_dump_wait(MemdebugDump* dump) {
+    return heap_dump_reap(dump, 0);
+}
+
+// Start walking every live allocation, for reporters and exporters of your own. The walk reads
+// the same heap snapshot as print_heap_exact(), one group of slots at a time into the MemdebugIter,
+// so it needs no memory in proportion to the heap, and the program can keep allocating while
+// it runs. The walk holds the lock that comes before every other memdebug lock, so the code
+// between may allocate, free and print, and heap reports in other threads wait for the walk.
+//
+// Until memdebug_iter_end(), this thread must not call print_heap_exact(), print_heap_fork() or
+// memdebug_iter_begin() again. They need the same lock, which isn't recursive, so they would
+// deadlock. Instead they refuse: print_heap_exact() prints a note instead of the report,
+// print_heap_fork() returns 1, and the second walk is empty.
+void memdebug_iter_begin(MemdebugIter* it) {
+    memset(it, 0, sizeof(MemdebugIter));
+    if (heap_walk)
+        return;
+    heap_snapshot_begin();
+    heap_walk = it;
+    heap_snapshot_cursor(it->cursor);
+}
+
+// Returns false once every allocation that was live when the walk began has been returned.
+bool memdebug_iter_next(MemdebugIter* it, MemdebugRecord* record) {
+    if (heap_walk != it)
+        return false;
+    if (it->next == it->count) {
+        MemAlloc group[MEMDEBUG_GROUP_WIDTH];
+        it->count = heap_snapshot_read(it->cursor, group);
+        it->next = 0;
+        for (size_t i = 0; i < it->count; i++) {
+            const CallSite* site = site_get(group[i].site);
+            it->records[i].ptr = memalloc_ptr(&group[i]);
+            it->records[i].size = memalloc_size(&group[i]);
+            it->records[i].file = site->file;
+            it->records[i].func = site->func;
+            it->records[i].line = site->line;
         }
+        if (!it->count)
+            return false;
+    }
+    *record = it->records[it->next++];
+    return true;
+}
+
+void memdebug_iter_end(MemdebugIter* it) {
+    if (heap_walk == it) {
+        heap_walk = NULL;
+        heap_snapshot_end();
+    }
+    memset(it, 0, sizeof(MemdebugIter));
+}
+
+// The report printed when the program runs out of memory. It's short, and allocates nothing.
+void low_mem_print_heap() {
+    size_t total_allocated = 0;
+    size_t num_allocs = 0;
+
+    mutex_lock(&oom_mutex);
+    events_drain_nowait();
+    size_t ranked = site_rank_top(oom_ranks, MEMDEBUG_OOM_SITES, MEMDEBUG_BY_BYTES, site_num_nowait(), &total_allocated, &num_allocs);
+    print_heap_dump_header();
+    printf("Top %zu call sites by live bytes:\n", ranked);
+    for (size_t i = 0; i < ranked; i++) {
+        CallSite* site = oom_ranks[i].site;
+        print_alloc_summary(oom_ranks[i].live_count, oom_ranks[i].live_bytes, (char*)site->file, (char*)site->func, site->line);
     }
 
-    MEMDEBUG_UNLOCK_MUTEX;
+#if MEMDEBUG_OOM_PRINT_POINTERS
+    // The records are printed where they are, so thread logs are not published first.
+    size_t skipped = thread_logs_for_each_nowait(low_mem_print_visit, NULL);
+    skipped += alloc_for_each_nowait(low_mem_print_visit, NULL);
+    if (skipped)
+        printf("%zu shards or thread logs were locked and have been left out.\n", skipped);
+#endif
 
-    print_heap_summary_totals(total_allocated, num_allocs);
+    print_heap_summary_totals(total_allocated, num_allocs, tracker_memory_nowait());
+    mutex_unlock(&oom_mutex);
 }
 
 size_t get_num_allocs() {
-    return num_allocs;
+    thread_logs_flush();
+    return alloc_count();
+}
+
+// Memory mapped for memdebug's own tables and records, which is not part of the heap.
+size_t get_tracker_bytes() {
+    return tracker_memory();
+}
+
+// Instrumented malloc(), realloc() and free() calls that memdebug knows about. Where the call sites
+// can be found at startup, this counts every one in the program, including ones that never ran.
+size_t get_num_call_sites() {
+    return site_num();
 }
 
 /*********************************************/
 /* malloc(), realloc(), free() Redefinitions */
 /*********************************************/
 
-void* memdebug_malloc(size_t n, size_t line, const char* func, const char* file) {
+void* memdebug_malloc(size_t n, CallSite* site) {
     // Call malloc()
     void* ptr = malloc(n);
-    if (!ptr) OOM(line, func, file, n);
+    if (!ptr) OOM(site->line, site->func, site->file, n);
 
-#if PRINT_MEMALLOCS
-    // Print message
-    printf(ANSI_COLOR_FUNC "malloc(" ANSI_COLOR_RESET
-               ANSI_COLOR_BYTE "%zu" ANSI_COLOR_RESET
-                   ANSI_COLOR_FUNC ")" ANSI_COLOR_RESET
-                           " -> " ANSI_COLOR_PNTR "%p" ANSI_COLOR_RESET
-                           " on line " ANSI_COLOR_LINE "%zu" ANSI_COLOR_RESET
-                           " of " ANSI_COLOR_FUNC "%s()" ANSI_COLOR_RESET
-                           " in " ANSI_COLOR_FILE "%s" ANSI_COLOR_RESET
-                           ".\n",
-           n, ptr, line, func, file);
-    fflush(stdout);
+    // Keep a record of it
+    if (!memalloc_fits(ptr, n)) {
+        mempanic(ptr, "Pointer or size does not fit in 48 bits. Build with MEMDEBUG_PACK_POINTERS=0.", site->line, site->func, site->file);
+    }
+    thread_log_add(memalloc_make(ptr, n, site_id(site)));
+    site_count_alloc(site, n);
+
+#if MEMDEBUG_EVENTS
+    // Print message, and trace it. Events come after the record changes, for trace keyframes.
+    memdebug_event(MEMDEBUG_EVENT_MALLOC, ptr, NULL, 0, n, site);
 #endif
 
-    // Keep a record of it
-    MemAlloc newalloc;
-    newalloc.ptr = ptr;
-    newalloc.size = n;
-    newalloc.line = line;
-    newalloc.func = func;
-    newalloc.file = file;
-
-    MEMDEBUG_LOCK_MUTEX;
-    alloc_add(newalloc);
-    MEMDEBUG_UNLOCK_MUTEX;
     return ptr;
 }
 
-void* memdebug_realloc(void* ptr, size_t n, size_t line, const char* func, const char* file) {
-    MEMDEBUG_LOCK_MUTEX;
-
+void* memdebug_realloc(void* ptr, size_t n, CallSite* site) {
     // Check to make sure the allocation exists, and keep track of the location
-    bool removed = alloc_remove(ptr);
+    MemAlloc old;
+    bool removed = thread_log_remove(ptr, &old);
     if (ptr != NULL && !removed) {
-        mempanic(ptr, "Tried to realloc() an invalid pointer.", line, func, file);
+        mempanic(ptr, "Tried to realloc() an invalid pointer.", site->line, site->func, site->file);
     }
+    if (removed)
+        site_count_free(old.site, memalloc_size(&old));
+
+#if MEMDEBUG_TRACE
+    // Once realloc() frees ptr, another thread can be given it before this event is timed, so
+    // the trace also records when the record of ptr went.
+    uint64_t released = event_load(&trace_on) ? clock_ns() : 0;
+#elif MEMDEBUG_EVENTS
+    uint64_t released = 0;
+#endif
 
     // Call realloc()
     void* newptr = realloc(ptr, n);
-    if (!newptr) OOM(line, func, file, n);
-
-#if PRINT_MEMALLOCS
-    // Print message
-    printf(
-        ANSI_COLOR_FUNC "realloc(" ANSI_COLOR_RESET
-            ANSI_COLOR_PNTR "%p" ANSI_COLOR_RESET
-                ANSI_COLOR_FUNC ", " ANSI_COLOR_RESET
-                    ANSI_COLOR_BYTE "%zu" ANSI_COLOR_RESET
-                        ANSI_COLOR_FUNC ")" ANSI_COLOR_RESET
-                        " -> " ANSI_COLOR_PNTR "%p" ANSI_COLOR_RESET
-                        " on line " ANSI_COLOR_LINE "%zu" ANSI_COLOR_RESET
-                        " of " ANSI_COLOR_FUNC "%s()" ANSI_COLOR_RESET
-                        " in " ANSI_COLOR_FUNC "%s" ANSI_COLOR_RESET
-                        ".\n",
-        ptr, n, newptr, line, func, file);
-    fflush(stdout);
-#endif
+    if (!newptr) OOM(site->line, site->func, site->file, n);
 
     // Update the record of allocations
-    MemAlloc newalloc;
-    newalloc.ptr = newptr;
-    newalloc.size = n;
-    newalloc.line = line;
-    newalloc.func = func;
-    newalloc.file = file;
-    alloc_add(newalloc);
+    if (!memalloc_fits(newptr, n)) {
+        mempanic(newptr, "Pointer or size does not fit in 48 bits. Build with MEMDEBUG_PACK_POINTERS=0.", site->line, site->func, site->file);
+    }
+    thread_log_add(memalloc_make(newptr, n, site_id(site)));
+    site_count_alloc(site, n);
 
-    MEMDEBUG_UNLOCK_MUTEX;
+#if MEMDEBUG_EVENTS
+    // Print message, and trace it. The old pointer comes from the record, since ptr is now freed.
+    memdebug_event(MEMDEBUG_EVENT_REALLOC, newptr, removed ? memalloc_ptr(&old) : NULL, released, n, site);
+#endif
 
     return newptr;
 }
 
-void memdebug_free(void* ptr, size_t line, const char* func, const char* file) {
-    MEMDEBUG_LOCK_MUTEX;
-
+void memdebug_free(void* ptr, CallSite* site) {
     // Check to make sure the allocation exists, and keep track of the location
-    bool removed = alloc_remove(ptr);
+    MemAlloc old;
+    bool removed = thread_log_remove(ptr, &old);
     if (ptr != NULL && !removed) {
-        mempanic(ptr, "Tried to free() an invalid pointer.", line, func, file);
+        mempanic(ptr, "Tried to free() an invalid pointer.", site->line, site->func, site->file);
     }
+    if (removed)
+        site_count_free(old.site, memalloc_size(&old));
 
-    MEMDEBUG_UNLOCK_MUTEX;
+#if MEMDEBUG_EVENTS
+    // Print message, and trace it
+    memdebug_event(MEMDEBUG_EVENT_FREE, ptr, NULL, 0, 0, site);
+#endif
 
     // Call free()
     free(ptr);
-
-#if PRINT_MEMALLOCS
-    // Print message
-    printf(
-        ANSI_COLOR_FUNC "free(" ANSI_COLOR_RESET
-            ANSI_COLOR_PNTR "%p" ANSI_COLOR_RESET
-                ANSI_COLOR_FUNC ")" ANSI_COLOR_RESET
-                        " on line " ANSI_COLOR_LINE "%zu" ANSI_COLOR_RESET
-                        " of " ANSI_COLOR_FUNC "%s()" ANSI_COLOR_RESET
-                        " in " ANSI_COLOR_FILE "%s" ANSI_COLOR_RESET
-                        ".\n",
-        ptr, line, func, file);
-    fflush(stdout);
-#endif
 }
 
 // Wrap malloc(), realloc(), free() with the new functionality
 
-#define malloc(n) memdebug_malloc(n, __LINE__, __func__, __FILE__)
-#define realloc(ptr, n) memdebug_realloc(ptr, n, __LINE__, __func__, __FILE__)
-#define free(ptr) memdebug_free(ptr, __LINE__, __func__, __FILE__)
+#define malloc(n) memdebug_malloc(n, MEMDEBUG_CALL_SITE())
+#define realloc(ptr, n) memdebug_realloc(ptr, n, MEMDEBUG_CALL_SITE())
+#define free(ptr) memdebug_free(ptr, MEMDEBUG_CALL_SITE())
 
 #else  // MEMDEBUG flag is disabled
 /*************************************************************************************/
 /* Define externally visible functions to do nothing when debugging flag is disabled */
 /*************************************************************************************/
+#include <stdbool.h>
 #include <stdlib.h>
 
 void print_heap() {}
+void print_heap_exact() {}
+void print_heap_top(size_t k, MemdebugOrder order_by) { (void)k; (void)order_by; }
+void set_heap_scan_threads(size_t num_threads) { (void)num_threads; }
+int print_heap_fork(const char* path, MemdebugDump* dump) { (void)path; (void)dump; return 1; }
+int heap_dump_poll(MemdebugDump* dump) { (void)dump; return -1; }
+int heap_dump_wait(MemdebugDump* dump) { (void)dump; return -1; }
+void memdebug_iter_begin(MemdebugIter* it) { (void)it; }
+bool memdebug_iter_next(MemdebugIter* it, MemdebugRecord* record) { (void)it; (void)record; return false; }
+void memdebug_iter_end(MemdebugIter* it) { (void)it; }
+int memdebug_trace_start(const char* path) { (void)path; return 1; }
+void memdebug_trace_stop() {}
 void low_mem_print_heap() {}
 size_t get_num_allocs() { return 0; }
+size_t get_tracker_bytes() { return 0; }
+size_t get_num_call_sites() { return 0; }
 #endif
 #endif  // Include guard
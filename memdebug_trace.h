@@ -0,0 +1,686 @@
+/*****************************/
+/* memdebug Allocation Trace */
+/*****************************/
+#ifndef __INCLUDED_MEMDEBUG_TRACE
+#define __INCLUDED_MEMDEBUG_TRACE
+
+/*
+ * Reads the traces that memdebug_trace_start() writes. Include this before memdebug.h, if at
+ * all, so that the reader's own allocations aren't tracked.
+ *
+ * Version 3 of the format. The file starts with:
+ *   "MDTRACE\0"  8 bytes
+ *   version      1 byte
+ *   shift        1 byte, log2 of malloc()'s alignment in the traced program
+ * Then blocks follow until the end of the file, each with a 17 byte header, little endian:
+ *   stored size  4 bytes, of what follows the header
+ *   raw size     4 bytes, of the records once decompressed, at most 65536
+ *   time         8 bytes, to take the first event's time difference from
+ *   method       1 byte. The low 2 bits are 0 if the records are stored as they are, 1 if in
+ *                the LZ4 block format, or 2 for the index below. 0x80 is set if a keyframe
+ *                starts the block.
+ * Each block can be read on its own, given the strings and sites from the blocks before it,
+ * since the differences below start over at the start of the block: the last pointer and
+ * thread are taken to be 0. So a reader can find every block from the headers alone, and
+ * decompress them in any order, or in parallel.
+ *
+ * Inside a block, every number is an unsigned LEB128 varint, 7 bits to a byte with the high
+ * bit set on all but the last, unless it says otherwise. Differences are zigzag encoded first,
+ * so that small ones of either sign stay small. Records never cross blocks, and each starts
+ * with a tag byte:
+ *   0xF0  String: its length, then its bytes. Strings are numbered from 0 in the order they appear.
+ *   0xF1  Call site: its id, the string for its file, the string for its function, its line.
+ *   0xF2  Keyframe: its time since the trace started. The strings start over from 0, and every
+ *         site is written again before it's next used, so a reader can start here.
+ *   0xF3  Live allocations in the keyframe: how many, then for each, its site shifted left one
+ *         with the low bit set if its pointer isn't aligned, its pointer as for an event, the
+ *         pointer's low bits if the site's low bit was set, and its size.
+ *   0xF4  End of the keyframe: how many live allocations it had.
+ *   0x00-0x1F  Event. The low 2 bits are the kind, 0 malloc(), 1 realloc() or 2 free(), and
+ *         the other bits are flags:
+ *         0x04  The thread changed. The new thread's id comes first.
+ *         0x08  The pointer isn't aligned, so its low bits follow it, as a byte.
+ *         0x10  The same for the pointer realloc() was passed.
+ *       The time in nanoseconds since the last event, or since the trace started, as a difference.
+ *       The call site, which is written before its first event.
+ *       The pointer shifted right by shift, as a difference from the last event's.
+ *       For realloc(), the pointer it was passed, shifted, as a difference from this event's
+ *       pointer, then how many nanoseconds before the event's time it let go of that pointer.
+ *       For malloc() and realloc(), the size.
+ * Events are in order for each thread, but the threads are only roughly in order with each other.
+ *
+ * Each event is timed after the allocation records changed, and a keyframe is timed before the
+ * heap snapshot it's taken from. So the live heap at time T is the last keyframe at or before T,
+ * plus the changes timed from the keyframe to T, applied in time order, any that the snapshot
+ * already saw having no further effect. A realloc() is two changes: the old pointer goes at
+ * old_time, which another thread could be given before the event's time, and the new one
+ * comes at its time. Since the threads are only roughly in order, events up
+ * to T can be written a little after events past it.
+ *
+ * When the trace is stopped, an index goes after the last block: a block header with method 2,
+ * then how many keyframes there were, then each one's file offset and time, as differences from
+ * the one before. The last 16 bytes of the file are the offset of that header, 8 bytes little
+ * endian, and "MDINDEX\0". A trace that was never stopped has no index, but its keyframes can
+ * still be found from the block headers.
+ */
+// For fseeko() and ftello() under -std=c99 or -std=c11. See memdebug.h.
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_MALLOC 0
+#define TRACE_REALLOC 1
+#define TRACE_FREE 2
+#define TRACE_KEYFRAME 3      // time is the keyframe's
+#define TRACE_LIVE 4          // An allocation live at the keyframe: ptr, size and site
+#define TRACE_KEYFRAME_END 5  // size is how many there were
+
+struct TraceEvent;
+typedef struct TraceEvent TraceEvent;
+struct TraceEvent {
+    int kind;
+    uint32_t thread;
+    uint64_t time;      // Nanoseconds since the trace started
+    uint64_t ptr;       // What was returned, or freed
+    uint64_t old_ptr;   // What was passed to realloc()
+    uint64_t old_time;  // When realloc() let go of old_ptr
+    uint64_t size;
+    uint32_t site;
+    const char* file;
+    const char* func;
+    uint64_t line;
+};
+
+struct TraceSite;
+typedef struct TraceSite TraceSite;
+struct TraceSite {
+    const char* file;  // NULL until the site has been read
+    const char* func;
+    uint64_t line;
+};
+
+struct TraceKeyframe;
+typedef struct TraceKeyframe TraceKeyframe;
+struct TraceKeyframe {
+    uint64_t offset;  // To pass to trace_reader_seek()
+    uint64_t time;
+};
+
+struct TraceReader;
+typedef struct TraceReader TraceReader;
+struct TraceReader {
+    FILE* file;
+    int version;
+    int shift;
+    const char* error;  // Why trace_reader_next() failed
+
+    char** strings;  // By id, out of names
+    size_t num_strings;
+    size_t strings_capacity;
+    char** names;  // Every string read, once each, so they outlast keyframes. A power of two, at most half full.
+    size_t num_names;
+    size_t names_capacity;
+    TraceSite* sites;
+    size_t sites_capacity;
+    TraceKeyframe* keyframes;  // From trace_reader_keyframes()
+    size_t num_keyframes;
+    size_t keyframes_capacity;
+
+    uint64_t time;
+    uint64_t ptr;  // Shifted
+    uint32_t thread;
+    uint64_t keyframe;   // The time of the last keyframe
+    uint64_t live_left;  // In the live allocations record being read
+    bool ended;          // At the index
+    size_t events;
+
+    uint64_t offset;     // How far into the file the reader is
+    uint64_t raw_bytes;  // The records read so far, decompressed
+    size_t pos;          // In the block
+    size_t len;
+    uint8_t buf[65536];  // The block being read, decompressed
+    uint8_t packed[65536 + 65536 / 255 + 16];
+};
+
+// Returns EOF at the end of the block.
+static inline int
+trace_reader_byte(TraceReader* r) {
+    return r->pos < r->len ? r->buf[r->pos++] : EOF;
+}
+
+static inline uint64_t
+trace_reader_le(const uint8_t* in, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++)
+        value |= (uint64_t)in[i] << (8 * i);
+    return value;
+}
+
+// FNV-1a.
+static inline size_t
+trace_reader_hash(const uint8_t* bytes, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    return (size_t)hash;
+}
+
+// Decompress an LZ4 block into exactly raw bytes, checking every length against both buffers.
+static inline bool
+trace_reader_lz(const uint8_t* src, size_t len, uint8_t* dst, size_t raw) {
+    size_t i = 0, o = 0;
+    while (i < len) {
+        int token = src[i++];
+        size_t literals = (size_t)(token >> 4), match = (size_t)(token & 15);
+        if (literals == 15) {
+            int byte;
+            do {
+                if (i == len)
+                    return false;
+                byte = src[i++];
+                literals += (size_t)byte;
+            } while (byte == 255);
+        }
+        if (literals > len - i || literals > raw - o)
+            return false;
+        memcpy(dst + o, src + i, literals);
+        i += literals;
+        o += literals;
+        if (i == len)
+            break;
+
+        if (len - i < 2)
+            return false;
+        size_t offset = (size_t)src[i] | (size_t)src[i + 1] << 8;
+        i += 2;
+        if (match == 15) {
+            int byte;
+            do {
+                if (i == len)
+                    return false;
+                byte = src[i++];
+                match += (size_t)byte;
+            } while (byte == 255);
+        }
+        match += 4;
+        if (!offset || offset > o || match > raw - o)
+            return false;
+        // The copy can overlap what it writes, so a byte at a time.
+        for (size_t k = 0; k < match; k++, o++)
+            dst[o] = dst[o - offset];
+    }
+    return o == raw;
+}
+
+// Read the next block. Returns 1 if there was one, 0 at the index or the end of the file, or -1 if
+// it's corrupt.
+static inline int
+trace_reader_block(TraceReader* r) {
+    uint8_t header[17];
+    size_t got = fread(header, 1, sizeof(header), r->file);
+    if (!got)
+        return 0;
+    uint64_t stored = trace_reader_le(header, 4), raw = trace_reader_le(header + 4, 4);
+    int method = header[16] & 0x7F;
+    if (got == sizeof(header) && method == 2) {
+        r->ended = true;
+        return 0;
+    }
+    if (got < sizeof(header) || raw > sizeof(r->buf) || stored > sizeof(r->packed) || method > 1 ||
+        (method == 0 && stored != raw)) {
+        r->error = "A block header in the trace is corrupt.";
+        return -1;
+    }
+    uint8_t* dst = method ? r->packed : r->buf;
+    if (fread(dst, 1, (size_t)stored, r->file) != stored) {
+        r->error = "The trace ends in the middle of a block.";
+        return -1;
+    }
+    if (method == 1 && !trace_reader_lz(r->packed, (size_t)stored, r->buf, (size_t)raw)) {
+        r->error = "A block in the trace doesn't decompress.";
+        return -1;
+    }
+
+    r->offset += sizeof(header) + stored;
+    r->raw_bytes += raw;
+    r->pos = 0;
+    r->len = (size_t)raw;
+    r->time = trace_reader_le(header + 8, 8);
+    r->thread = 0;
+    r->ptr = 0;
+    return 1;
+}
+
+static inline bool
+trace_reader_varint(TraceReader* r, uint64_t* value) {
+    *value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        int byte = trace_reader_byte(r);
+        if (byte == EOF) {
+            r->error = "A record in the trace runs past the end of its block.";
+            return false;
+        }
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    r->error = "A number in the trace is too long.";
+    return false;
+}
+
+static inline bool
+trace_reader_zigzag(TraceReader* r, uint64_t* difference) {
+    uint64_t value;
+    if (!trace_reader_varint(r, &value))
+        return false;
+    *difference = (value >> 1) ^ ((uint64_t)0 - (value & 1));
+    return true;
+}
+
+// Find a string among those already read, or keep a copy of it.
+static inline char*
+trace_reader_name(TraceReader* r, const uint8_t* bytes, size_t len) {
+    if (r->num_names * 2 >= r->names_capacity) {
+        size_t capacity = r->names_capacity ? r->names_capacity * 2 : 256;
+        char** names = (char**)calloc(capacity, sizeof(char*));
+        if (!names)
+            return NULL;
+        for (size_t i = 0; i < r->names_capacity; i++) {
+            if (!r->names[i])
+                continue;
+            size_t j = trace_reader_hash((const uint8_t*)r->names[i], strlen(r->names[i])) & (capacity - 1);
+            while (names[j])
+                j = (j + 1) & (capacity - 1);
+            names[j] = r->names[i];
+        }
+        free(r->names);
+        r->names = names;
+        r->names_capacity = capacity;
+    }
+
+    size_t i = trace_reader_hash(bytes, len) & (r->names_capacity - 1);
+    for (; r->names[i]; i = (i + 1) & (r->names_capacity - 1))
+        if (strlen(r->names[i]) == len && !memcmp(r->names[i], bytes, len))
+            return r->names[i];
+    char* name = (char*)malloc(len + 1);
+    if (!name)
+        return NULL;
+    memcpy(name, bytes, len);
+    name[len] = '\0';
+    r->names[i] = name;
+    r->num_names++;
+    return name;
+}
+
+static inline bool
+trace_reader_string(TraceReader* r) {
+    uint64_t len;
+    if (!trace_reader_varint(r, &len))
+        return false;
+    if (len > r->len - r->pos) {
+        r->error = "A string in the trace runs past the end of its block.";
+        return false;
+    }
+    if (r->num_strings == r->strings_capacity) {
+        size_t capacity = r->strings_capacity ? r->strings_capacity * 2 : 64;
+        char** strings = (char**)realloc(r->strings, sizeof(char*) * capacity);
+        if (!strings) {
+            r->error = "Out of memory.";
+            return false;
+        }
+        r->strings = strings;
+        r->strings_capacity = capacity;
+    }
+    char* str = trace_reader_name(r, r->buf + r->pos, (size_t)len);
+    if (!str) {
+        r->error = "Out of memory.";
+        return false;
+    }
+    r->pos += (size_t)len;
+    r->strings[r->num_strings++] = str;
+    return true;
+}
+
+static inline bool
+trace_reader_site(TraceReader* r) {
+    uint64_t id, file, func, line;
+    if (!trace_reader_varint(r, &id) || !trace_reader_varint(r, &file) ||
+        !trace_reader_varint(r, &func) || !trace_reader_varint(r, &line))
+        return false;
+    if (id > UINT32_MAX || file >= r->num_strings || func >= r->num_strings) {
+        r->error = "A call site in the trace refers to something that isn't there.";
+        return false;
+    }
+    if (id >= r->sites_capacity) {
+        size_t capacity = r->sites_capacity ? r->sites_capacity : 64;
+        while (capacity <= id)
+            capacity *= 2;
+        TraceSite* sites = (TraceSite*)realloc(r->sites, sizeof(TraceSite) * capacity);
+        if (!sites) {
+            r->error = "Out of memory.";
+            return false;
+        }
+        memset(sites + r->sites_capacity, 0, sizeof(TraceSite) * (capacity - r->sites_capacity));
+        r->sites = sites;
+        r->sites_capacity = capacity;
+    }
+    r->sites[id].file = r->strings[file];
+    r->sites[id].func = r->strings[func];
+    r->sites[id].line = line;
+    return true;
+}
+
+// Read one pointer and its low bits, if the flag says they follow.
+static inline bool
+trace_reader_ptr(TraceReader* r, uint64_t base, bool low, uint64_t* shifted, uint64_t* ptr) {
+    uint64_t difference;
+    if (!trace_reader_zigzag(r, &difference))
+        return false;
+    *shifted = base + difference;
+    *ptr = *shifted << r->shift;
+    if (low) {
+        int byte = trace_reader_byte(r);
+        if (byte == EOF) {
+            r->error = "An event in the trace runs past the end of its block.";
+            return false;
+        }
+        *ptr |= (uint64_t)byte;
+    }
+    return true;
+}
+
+static inline bool
+trace_reader_site_of(TraceReader* r, uint64_t site, TraceEvent* ev) {
+    if (site >= r->sites_capacity || !r->sites[site].file) {
+        r->error = "An event in the trace is from a call site that isn't there.";
+        return false;
+    }
+    ev->site = (uint32_t)site;
+    ev->file = r->sites[site].file;
+    ev->func = r->sites[site].func;
+    ev->line = r->sites[site].line;
+    return true;
+}
+
+static inline bool
+trace_reader_event(TraceReader* r, int tag, TraceEvent* ev) {
+    uint64_t value, shifted, old_shifted;
+    memset(ev, 0, sizeof(TraceEvent));
+    ev->kind = tag & 3;
+    if (ev->kind > TRACE_FREE || tag > 0x1F) {
+        r->error = "The trace has a record of a kind this reader doesn't know.";
+        return false;
+    }
+
+    if (tag & 0x04) {
+        if (!trace_reader_varint(r, &value))
+            return false;
+        r->thread = (uint32_t)value;
+    }
+    if (!trace_reader_zigzag(r, &value))
+        return false;
+    r->time += value;
+    if (!trace_reader_varint(r, &value) || !trace_reader_site_of(r, value, ev))
+        return false;
+
+    if (!trace_reader_ptr(r, r->ptr, tag & 0x08, &shifted, &ev->ptr))
+        return false;
+    if (ev->kind == TRACE_REALLOC) {
+        if (!trace_reader_ptr(r, shifted, tag & 0x10, &old_shifted, &ev->old_ptr) || !trace_reader_varint(r, &value))
+            return false;
+        ev->old_time = r->time - value;
+    }
+    if (ev->kind != TRACE_FREE && !trace_reader_varint(r, &ev->size))
+        return false;
+
+    r->ptr = shifted;
+    ev->thread = r->thread;
+    ev->time = r->time;
+    r->events++;
+    return true;
+}
+
+// Start a keyframe: the strings and sites start over.
+static inline bool
+trace_reader_keyframe(TraceReader* r, TraceEvent* ev) {
+    uint64_t time;
+    if (!trace_reader_varint(r, &time))
+        return false;
+    r->num_strings = 0;
+    if (r->sites)
+        memset(r->sites, 0, sizeof(TraceSite) * r->sites_capacity);
+    r->keyframe = time;
+    r->live_left = 0;
+    memset(ev, 0, sizeof(TraceEvent));
+    ev->kind = TRACE_KEYFRAME;
+    ev->time = time;
+    return true;
+}
+
+// One allocation out of a live allocations record.
+static inline bool
+trace_reader_live(TraceReader* r, TraceEvent* ev) {
+    uint64_t site, shifted;
+    memset(ev, 0, sizeof(TraceEvent));
+    ev->kind = TRACE_LIVE;
+    ev->time = r->keyframe;
+    if (!trace_reader_varint(r, &site) || !trace_reader_site_of(r, site >> 1, ev) ||
+        !trace_reader_ptr(r, r->ptr, site & 1, &shifted, &ev->ptr) || !trace_reader_varint(r, &ev->size))
+        return false;
+    r->ptr = shifted;
+    r->live_left--;
+    return true;
+}
+
+// Open a trace. Returns 0 on success, or 1 with r->error saying why not.
+static inline int
+trace_reader_open(TraceReader* r, const char* path) {
+    memset(r, 0, sizeof(TraceReader));
+    r->file = fopen(path, "rb");
+    if (!r->file) {
+        r->error = "Could not open the trace.";
+        return 1;
+    }
+
+    uint8_t header[10] = {0};
+    size_t got = fread(header, 1, sizeof(header), r->file);
+    r->version = header[8];
+    r->shift = header[9];
+    r->offset = sizeof(header);
+    if (got < sizeof(header) || memcmp(header, "MDTRACE", 8)) {
+        r->error = "Not a memdebug trace.";
+    } else if (r->version != 3) {
+        r->error = "The trace is from a version of memdebug this reader doesn't know.";
+    } else if (r->shift > 8) {
+        r->error = "The trace's header is corrupt.";
+    } else {
+        return 0;
+    }
+    fclose(r->file);
+    r->file = NULL;
+    return 1;
+}
+
+// Read the next event, or keyframe record. Returns 1 if there was one, 0 at the end of the
+// trace, or -1 with r->error saying what was wrong with it.
+static inline int
+trace_reader_next(TraceReader* r, TraceEvent* ev) {
+    if (r->live_left)
+        return trace_reader_live(r, ev) ? 1 : -1;
+    for (;;) {
+        int tag = trace_reader_byte(r);
+        if (tag == EOF) {
+            int status = r->ended ? 0 : trace_reader_block(r);
+            if (status < 1)
+                return status;
+            continue;
+        }
+        if (tag == 0xF0) {
+            if (!trace_reader_string(r))
+                return -1;
+        } else if (tag == 0xF1) {
+            if (!trace_reader_site(r))
+                return -1;
+        } else if (tag == 0xF2) {
+            return trace_reader_keyframe(r, ev) ? 1 : -1;
+        } else if (tag == 0xF3) {
+            if (!trace_reader_varint(r, &r->live_left))
+                return -1;
+            if (r->live_left)
+                return trace_reader_live(r, ev) ? 1 : -1;
+        } else if (tag == 0xF4) {
+            memset(ev, 0, sizeof(TraceEvent));
+            ev->kind = TRACE_KEYFRAME_END;
+            ev->time = r->keyframe;
+            return trace_reader_varint(r, &ev->size) ? 1 : -1;
+        } else {
+            return trace_reader_event(r, tag, ev) ? 1 : -1;
+        }
+    }
+}
+
+static inline bool
+trace_reader_fseek(TraceReader* r, uint64_t offset) {
+#ifdef _WIN32
+    return !_fseeki64(r->file, (__int64)offset, SEEK_SET);
+#else
+    return !fseeko(r->file, (off_t)offset, SEEK_SET);
+#endif
+}
+
+// Carry on reading from a keyframe's offset. Returns 0 on success, or -1 with r->error.
+static inline int
+trace_reader_seek(TraceReader* r, uint64_t offset) {
+    if (!trace_reader_fseek(r, offset)) {
+        r->error = "Could not seek in the trace.";
+        return -1;
+    }
+    r->offset = offset;
+    r->pos = r->len = 0;
+    r->live_left = 0;
+    r->ended = false;
+    return 0;
+}
+
+static inline bool
+trace_reader_add_keyframe(TraceReader* r, uint64_t offset, uint64_t time) {
+    if (r->num_keyframes == r->keyframes_capacity) {
+        size_t capacity = r->keyframes_capacity ? r->keyframes_capacity * 2 : 64;
+        TraceKeyframe* keyframes = (TraceKeyframe*)realloc(r->keyframes, sizeof(TraceKeyframe) * capacity);
+        if (!keyframes) {
+            r->error = "Out of memory.";
+            return false;
+        }
+        r->keyframes = keyframes;
+        r->keyframes_capacity = capacity;
+    }
+    r->keyframes[r->num_keyframes].offset = offset;
+    r->keyframes[r->num_keyframes].time = time;
+    r->num_keyframes++;
+    return true;
+}
+static inline bool
+trace_reader_ftell(TraceReader* r, uint64_t* offset) {
+#ifdef _WIN32
+    __int64 at = _ftelli64(r->file);
+#else
+    off_t at = ftello(r->file);
+#endif
+    *offset = (uint64_t)at;
+    return at >= 0;
+}
+
+// A varint from outside a block.
+static inline bool
+trace_reader_varint_in(const uint8_t* in, size_t len, size_t* pos, uint64_t* value) {
+    *value = 0;
+    for (unsigned shift = 0; shift < 64 && *pos < len; shift += 7) {
+        uint8_t byte = in[(*pos)++];
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// Read the index at the end of the trace.
+static inline bool
+trace_reader_index(TraceReader* r, uint64_t end) {
+    uint8_t trailer[16], header[17];
+    if (end < 10 + sizeof(header) + sizeof(trailer) || !trace_reader_fseek(r, end - sizeof(trailer)) ||
+        fread(trailer, 1, sizeof(trailer), r->file) != sizeof(trailer) || memcmp(trailer + 8, "MDINDEX", 8))
+        return false;
+    uint64_t at = trace_reader_le(trailer, 8);
+    if (at < 10 || at > end - sizeof(header) - sizeof(trailer) || !trace_reader_fseek(r, at) ||
+        fread(header, 1, sizeof(header), r->file) != sizeof(header) || (header[16] & 0x7F) != 2)
+        return false;
+    uint64_t len = trace_reader_le(header, 4);
+    if (len > end - sizeof(trailer) - at - sizeof(header))
+        return false;
+    uint8_t* index = (uint8_t*)malloc((size_t)len + 1);
+    bool ok = index && fread(index, 1, (size_t)len, r->file) == len;
+    size_t pos = 0;
+    uint64_t count, offset = 0, time = 0;
+    ok = ok && trace_reader_varint_in(index, (size_t)len, &pos, &count);
+    for (uint64_t i = 0; ok && i < count; i++) {
+        uint64_t offset_difference, time_difference;
+        ok = trace_reader_varint_in(index, (size_t)len, &pos, &offset_difference) &&
+             trace_reader_varint_in(index, (size_t)len, &pos, &time_difference) &&
+             trace_reader_add_keyframe(r, offset += offset_difference, time += time_difference);
+    }
+    free(index);
+    return ok;
+}
+
+// Find every keyframe, from the index if the trace has one, or else from the block headers.
+// Sets r->keyframes and r->num_keyframes, in order. Returns 0 on success, or -1 with r->error.
+static inline int
+trace_reader_keyframes(TraceReader* r) {
+    uint64_t here, end;
+    r->num_keyframes = 0;
+    if (!trace_reader_ftell(r, &here) || fseek(r->file, 0, SEEK_END) || !trace_reader_ftell(r, &end)) {
+        r->error = "Could not seek in the trace.";
+        return -1;
+    }
+
+    if (!trace_reader_index(r, end)) {
+        r->num_keyframes = 0;
+        uint8_t header[17];
+        uint64_t at = 10;
+        while (trace_reader_fseek(r, at) && fread(header, 1, sizeof(header), r->file) == sizeof(header) &&
+               (header[16] & 0x7F) != 2) {
+            uint64_t stored = trace_reader_le(header, 4);
+            if (stored > end - at - sizeof(header))
+                break;  // Cut short
+            if ((header[16] & 0x80) && !trace_reader_add_keyframe(r, at, trace_reader_le(header + 8, 8)))
+                return -1;
+            at += sizeof(header) + stored;
+        }
+    }
+
+    if (!trace_reader_fseek(r, here)) {
+        r->error = "Could not seek in the trace.";
+        return -1;
+    }
+    return 0;
+}
+
+static inline void
+trace_reader_close(TraceReader* r) {
+    if (r->file)
+        fclose(r->file);
+    for (size_t i = 0; i < r->names_capacity; i++)
+        free(r->names[i]);
+    free(r->names);
+    free(r->strings);
+    free(r->sites);
+    free(r->keyframes);
+    memset(r, 0, sizeof(TraceReader));
+}
+
+#endif  // End memdebug trace include guard
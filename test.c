@@ -1,3 +1,4 @@
+#define _DEFAULT_SOURCE  // For -std=c99 and the like, before any system header
 #include <stdio.h>
 #include <stdlib.h>
 
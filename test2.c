@@ -1,6 +1,12 @@
+#define _DEFAULT_SOURCE  // For -std=c99 and the like, before any system header
 #include <stdlib.h>
+#include <time.h>
+
+// Before memdebug.h, so that reading the trace back isn't traced.
+#include "memdebug_trace.h"
 
 #define MEMDEBUG 1
+#define PRINT_MEMALLOCS 0
 #include "memdebug.h"
 
 struct LL;
@@ -9,8 +15,152 @@ struct LL {
     LL* next;
 };
 
-int main() {
-    size_t num_allocs = 100000;
+// A forked dump should report the same heap, from the child.
+static void check_forked_dump(size_t expected) {
+#ifndef _WIN32
+    MemdebugDump dump;
+    if (print_heap_fork(NULL, &dump) || heap_dump_wait(&dump) != 1) {
+        printf("The forked heap dump failed.\n");
+        exit(1);
+    }
+
+    char line[256], want[64];
+    bool found = false;
+    snprintf(want, sizeof(want), "Total number of heap allocations: %zu\n", expected);
+    FILE* report = fopen(dump.path, "r");
+    while (report && fgets(line, sizeof(line), report))
+        found |= !strcmp(line, want);
+    if (report)
+        fclose(report);
+    remove(dump.path);
+    if (!found) {
+        printf("Expected %s to report %zu live allocations.\n", dump.path, expected);
+        exit(1);
+    }
+#endif
+}
+
+// Freeing a pointer twice should panic, even once its record has been moved into a shard's new
+// table and the old table still has a copy it hasn't dropped yet.
+#if !defined(_WIN32) && !MEMDEBUG_LOCKFREE && MEMDEBUG_REHASH_STEP
+#define MIGRATION_CALL_SITES 3
+#else
+#define MIGRATION_CALL_SITES 0
+#endif
+static void check_double_free_during_migration() {
+#if MIGRATION_CALL_SITES
+    fflush(stdout);
+    pid_t pid = fork();
+    if (!pid) {
+        if (!freopen("/dev/null", "w", stdout))
+            exit(1);
+        for (size_t n = 0; n < 10000000; n++) {
+            malloc(16);
+            for (size_t s = 0; s < alloc_shard_count; s++) {
+                AllocMap* map = &alloc_shards[s].map;
+                if (!map->old.capacity || !map->migrated || map->migrated + 4 * MEMDEBUG_REHASH_STEP > map->old.capacity)
+                    continue;
+                for (size_t idx = 0; idx < map->migrated; idx++) {
+                    if (map->old.ctrl[idx] & MEMDEBUG_CTRL_FULL) {
+                        void* ptr = memalloc_ptr(&map->old.slots[idx]);
+                        free(ptr);
+                        free(ptr);
+                        exit(0);
+                    }
+                }
+            }
+        }
+        exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != MEMPANIC_EXIT_STATUS) {
+        printf("Freeing a pointer twice while its shard was migrating did not panic.\n");
+        exit(1);
+    }
+#endif
+}
+
+// Walking the heap should find every node once, even while allocating. What else needs the
+// snapshot in the same thread should refuse rather than deadlock.
+static void check_iterator(size_t expected) {
+    MemdebugIter it, nested;
+    MemdebugRecord record;
+    MemdebugDump dump;
+    size_t count = 0, bytes = 0;
+    void* during = NULL;
+    memdebug_iter_begin(&it);
+    while (memdebug_iter_next(&it, &record)) {
+        if (!during) {
+            during = malloc(sizeof(LL));
+            memdebug_iter_begin(&nested);
+            if (memdebug_iter_next(&nested, &record) || !print_heap_fork(NULL, &dump)) {
+                printf("A second walk or a forked report did not refuse to run during a walk.\n");
+                exit(1);
+            }
+            memdebug_iter_end(&nested);
+        }
+        count++;
+        bytes += record.size;
+    }
+    memdebug_iter_end(&it);
+    free(during);
+
+    if (count != expected || bytes != expected * sizeof(LL)) {
+        printf("Expected to walk %zu allocations, found %zu totalling %zu bytes.\n", expected, count, bytes);
+        exit(1);
+    }
+}
+
+// A trace should read back as a keyframe with what was live when it started, then the calls
+// that were made, in order.
+static void check_trace() {
+    static TraceReader reader;
+    const char* path = "memdebug-test2.trace";
+    void* before = malloc(24);
+    if (memdebug_trace_start(path)) {
+        printf("Could not start a trace.\n");
+        exit(1);
+    }
+    size_t line = __LINE__ + 1;
+    void* ptr = malloc(10);
+    ptr = realloc(ptr, 1000);
+    free(ptr);
+    memdebug_trace_stop();
+    free(before);
+
+    TraceEvent events[4], ev;
+    size_t n = 0;
+    bool keyframed = false, found = false;
+    if (!trace_reader_open(&reader, path) && !trace_reader_keyframes(&reader) && reader.num_keyframes == 1 &&
+        reader.keyframes[0].offset == 10 && !trace_reader_seek(&reader, reader.keyframes[0].offset)) {
+        while (n < 4 && trace_reader_next(&reader, &ev) == 1) {
+            keyframed |= ev.kind == TRACE_KEYFRAME && !n;
+            found |= ev.kind == TRACE_LIVE && ev.ptr == (uintptr_t)before && ev.size == 24;
+            if (ev.kind <= TRACE_FREE)
+                events[n++] = ev;
+        }
+    }
+
+    bool ok = n == 3 && keyframed && found &&
+              events[0].kind == TRACE_MALLOC && events[0].size == 10 && events[0].line == line &&
+              events[1].kind == TRACE_REALLOC && events[1].size == 1000 && events[1].old_ptr == events[0].ptr &&
+              events[2].kind == TRACE_FREE && events[2].ptr == events[1].ptr && events[2].ptr == (uintptr_t)ptr &&
+              events[2].line == line + 2 && !strcmp(events[2].file, __FILE__) && !strcmp(events[2].func, __func__) &&
+              events[0].thread == events[2].thread && events[0].time <= events[2].time &&
+              reader.keyframes[0].time <= events[0].time;
+    trace_reader_close(&reader);
+    remove(path);
+    if (!ok) {
+        printf("The trace did not read back as a keyframe and the malloc(), realloc() and free() that were made.\n");
+        exit(1);
+    }
+}
+
+// Build a list of num_allocs + 1 nodes, optionally print the heap, then free it.
+static double build_and_free(size_t num_allocs, bool dump) {
+    clock_t start = clock();
 
     LL *ll, *original;
     ll = original = malloc(sizeof(LL));
@@ -20,7 +170,19 @@ int main() {
         ll = ll->next;
     }
 
-    print_heap();
+    if (get_num_allocs() != num_allocs + 1) {
+        printf("Expected %zu live allocations, found %zu.\n", num_allocs + 1, get_num_allocs());
+        exit(1);
+    }
+
+    // The per-site counters and the table should agree.
+    if (dump) {
+        print_heap();
+        print_heap_exact();
+        print_heap_top(1, MEMDEBUG_BY_BYTES);
+        check_forked_dump(num_allocs + 1);
+        check_iterator(num_allocs + 1);
+    }
 
     for (size_t i = 0; i < num_allocs + 1; i++) {
         ll = original;
@@ -28,5 +190,33 @@ int main() {
         free(ll);
     }
 
+    if (get_num_allocs() != 0) {
+        printf("Expected no live allocations, found %zu.\n", get_num_allocs());
+        exit(1);
+    }
+
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char** argv) {
+    size_t max_allocs = argc > 1 ? (size_t)strtoull(argv[1], NULL, 10) : 10000000;
+
+#if MEMDEBUG_SITE_SECTION
+    // The malloc()s and free()s in this file are all known before they run.
+    if (get_num_call_sites() != 10 + MIGRATION_CALL_SITES) {
+        printf("Expected %d call sites, found %zu.\n", 10 + MIGRATION_CALL_SITES, get_num_call_sites());
+        exit(1);
+    }
+#endif
+
+    check_trace();
+    check_double_free_during_migration();
+    build_and_free(100000, true);
     print_heap();
-}
\ No newline at end of file
+
+    // Scaling: tracking cost per live pointer should stay flat as the table grows.
+    for (size_t n = 1000; n <= max_allocs; n *= 10) {
+        double secs = build_and_free(n, false);
+        printf("%zu live pointers: %.3fs, %.1f ns per malloc/free pair\n", n, secs, secs * 1e9 / (double)(n + 1));
+    }
+}
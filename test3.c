@@ -0,0 +1,68 @@
+#define _DEFAULT_SOURCE  // For -std=c99 and the like, before any system header
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MEMDEBUG 1
+#define PRINT_MEMALLOCS 0
+#include "memdebug.h"
+
+struct LL;
+typedef struct LL LL;
+struct LL {
+    LL* next;
+};
+
+static size_t allocs_per_thread = 1000000;
+
+// The same linked list as test2.c, built and torn down by each thread on its own.
+static void* build_and_free(void* arg) {
+    (void)arg;
+    LL *ll, *original;
+    ll = original = malloc(sizeof(LL));
+
+    for (size_t i = 0; i < allocs_per_thread; i++) {
+        ll->next = malloc(sizeof(LL));
+        ll = ll->next;
+    }
+
+    for (size_t i = 0; i < allocs_per_thread + 1; i++) {
+        ll = original;
+        original = original->next;
+        free(ll);
+    }
+    return NULL;
+}
+
+static double wall_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+    size_t max_threads = argc > 1 ? (size_t)strtoull(argv[1], NULL, 10) : 8;
+    if (argc > 2)
+        allocs_per_thread = (size_t)strtoull(argv[2], NULL, 10);
+
+    pthread_t threads[256];
+    if (max_threads > 256)
+        max_threads = 256;
+
+    // Throughput should grow close to linearly with the thread count, up to the number of cores.
+    for (size_t n = 1; n <= max_threads; n *= 2) {
+        double start = wall_seconds();
+        for (size_t i = 0; i < n; i++)
+            pthread_create(threads + i, NULL, build_and_free, NULL);
+        for (size_t i = 0; i < n; i++)
+            pthread_join(threads[i], NULL);
+        double secs = wall_seconds() - start;
+
+        if (get_num_allocs() != 0) {
+            printf("Expected no live allocations, found %zu.\n", get_num_allocs());
+            exit(1);
+        }
+        printf("%zu threads: %.3fs, %.2f million malloc/free pairs per second\n",
+               n, secs, (double)(n * (allocs_per_thread + 1)) / secs / 1e6);
+    }
+}
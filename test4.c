@@ -0,0 +1,109 @@
+#define _DEFAULT_SOURCE  // For -std=c99 and the like, before any system header
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define MEMDEBUG 1
+#define PRINT_MEMALLOCS 0
+#ifndef MEMDEBUG_LOCKFREE
+#define MEMDEBUG_LOCKFREE 1
+#endif
+#include "memdebug.h"
+
+// Stress test for the allocation registry: every thread mallocs and frees as fast as it can,
+// handing some pointers to other threads to free, while another thread keeps printing the heap,
+// in this process and from forked children, and one more walks it, printing as it goes.
+
+#define NUM_THREADS 16
+#define ROUNDS 200
+#define BATCH 2000
+
+static _Atomic(void*) mailbox[NUM_THREADS];
+static atomic_bool done = false;
+
+static void* hammer(void* arg) {
+    size_t id = (size_t)arg;
+    unsigned seed = (unsigned)id;
+    void* batch[BATCH];
+
+    for (size_t round = 0; round < ROUNDS; round++) {
+        for (size_t i = 0; i < BATCH; i++)
+            batch[i] = malloc(1 + rand_r(&seed) % 256);
+
+        // Free in a random order, passing every 64th pointer on to the next thread.
+        for (size_t i = BATCH; i > 0; i--) {
+            size_t j = rand_r(&seed) % i;
+            void* ptr = batch[j];
+            batch[j] = batch[i - 1];
+            if (i % 64 == 0)
+                ptr = atomic_exchange(&mailbox[(id + 1) % NUM_THREADS], ptr);
+            free(ptr);
+        }
+    }
+    return NULL;
+}
+
+static void* reporter(void* arg) {
+    (void)arg;
+    while (!atomic_load(&done)) {
+        print_heap();
+        print_heap_exact();
+
+        MemdebugIter it;
+        MemdebugRecord record;
+        memdebug_iter_begin(&it);
+        while (memdebug_iter_next(&it, &record))
+            ;
+        memdebug_iter_end(&it);
+
+        // The child must not inherit a lock some hammer() thread was holding.
+        MemdebugDump dump;
+        if (print_heap_fork("/dev/null", &dump) || heap_dump_wait(&dump) != 1) {
+            printf("The forked heap dump failed.\n");
+            exit(1);
+        }
+    }
+    return NULL;
+}
+
+// The code between memdebug_iter_begin() and memdebug_iter_end() can print and allocate while
+// print_heap_fork() takes every lock in another thread.
+static void* walker(void* arg) {
+    (void)arg;
+    while (!atomic_load(&done)) {
+        MemdebugIter it;
+        MemdebugRecord record;
+        size_t count = 0;
+        memdebug_iter_begin(&it);
+        while (memdebug_iter_next(&it, &record)) {
+            if (count++ % 1024 == 0)
+                free(malloc(record.size));
+        }
+        printf("Walked %zu allocations.\n", count);
+        memdebug_iter_end(&it);
+    }
+    return NULL;
+}
+
+int main() {
+    pthread_t threads[NUM_THREADS], report, walk;
+    set_heap_scan_threads(4);
+    pthread_create(&report, NULL, reporter, NULL);
+    pthread_create(&walk, NULL, walker, NULL);
+    for (size_t i = 0; i < NUM_THREADS; i++)
+        pthread_create(threads + i, NULL, hammer, (void*)i);
+    for (size_t i = 0; i < NUM_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    atomic_store(&done, true);
+    pthread_join(report, NULL);
+    pthread_join(walk, NULL);
+
+    for (size_t i = 0; i < NUM_THREADS; i++)
+        free(atomic_exchange(&mailbox[i], NULL));
+
+    if (get_num_allocs() != 0) {
+        printf("Expected no live allocations, found %zu.\n", get_num_allocs());
+        return 1;
+    }
+    printf("All %d threads finished with no live allocations.\n", NUM_THREADS);
+}
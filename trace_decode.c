@@ -0,0 +1,306 @@
+#include "memdebug_trace.h"
+
+// Turns a trace from memdebug_trace_start() into text or CSV on stdout. With --at, prints the
+// allocations that were live that many seconds into the trace instead, starting from the
+// keyframe before it rather than from the start of the trace.
+// Usage: ./trace_decode [--csv] [--at seconds] trace
+
+// Events up to the time asked for can be written this long after later ones.
+#define SLACK_NS 1000000000ULL
+
+static const char* kind_names[] = {"malloc", "realloc", "free", "keyframe", "live", "keyframe_end"};
+
+static void print_text(TraceEvent* ev) {
+    printf("%llu.%09llu thread %u: ", (unsigned long long)(ev->time / 1000000000),
+           (unsigned long long)(ev->time % 1000000000), ev->thread);
+    if (ev->kind == TRACE_KEYFRAME) {
+        printf("keyframe\n");
+        return;
+    }
+    if (ev->kind == TRACE_KEYFRAME_END) {
+        printf("end of keyframe, %llu live allocations\n", (unsigned long long)ev->size);
+        return;
+    }
+    if (ev->kind == TRACE_MALLOC)
+        printf("malloc(%llu) -> 0x%llx", (unsigned long long)ev->size, (unsigned long long)ev->ptr);
+    else if (ev->kind == TRACE_REALLOC)
+        printf("realloc(0x%llx, %llu) -> 0x%llx", (unsigned long long)ev->old_ptr,
+               (unsigned long long)ev->size, (unsigned long long)ev->ptr);
+    else if (ev->kind == TRACE_LIVE)
+        printf("live 0x%llx, %llu bytes", (unsigned long long)ev->ptr, (unsigned long long)ev->size);
+    else
+        printf("free(0x%llx)", (unsigned long long)ev->ptr);
+    printf(" on line %llu of %s() in %s.\n", (unsigned long long)ev->line, ev->func, ev->file);
+}
+
+// Quote a field if it needs it, doubling any quotes inside.
+static void print_csv_field(const char* str) {
+    if (!strpbrk(str, ",\"\n")) {
+        fputs(str, stdout);
+        return;
+    }
+    putchar('"');
+    for (; *str; str++) {
+        if (*str == '"')
+            putchar('"');
+        putchar(*str);
+    }
+    putchar('"');
+}
+
+static void print_csv(TraceEvent* ev) {
+    printf("%llu,%u,%s,", (unsigned long long)ev->time, ev->thread, kind_names[ev->kind]);
+    if (ev->kind != TRACE_KEYFRAME && ev->kind != TRACE_KEYFRAME_END)
+        printf("0x%llx", (unsigned long long)ev->ptr);
+    putchar(',');
+    if (ev->kind == TRACE_REALLOC)
+        printf("0x%llx", (unsigned long long)ev->old_ptr);
+    putchar(',');
+    if (ev->kind != TRACE_FREE && ev->kind != TRACE_KEYFRAME)
+        printf("%llu", (unsigned long long)ev->size);
+    putchar(',');
+    if (ev->file)
+        print_csv_field(ev->file);
+    putchar(',');
+    if (ev->func)
+        print_csv_field(ev->func);
+    putchar(',');
+    if (ev->file)
+        printf("%llu", (unsigned long long)ev->line);
+    putchar('\n');
+}
+
+/* Heap reconstruction */
+
+// The live heap, by pointer, with linear probing. Pointers are never 0.
+static TraceEvent* live;
+static size_t live_capacity, num_live;
+
+static size_t live_slot(uint64_t ptr) {
+    size_t i = (size_t)((ptr >> 4) * 0x9E3779B97F4A7C15ULL) & (live_capacity - 1);
+    while (live[i].ptr && live[i].ptr != ptr)
+        i = (i + 1) & (live_capacity - 1);
+    return i;
+}
+
+static void live_put(TraceEvent* ev) {
+    if (num_live * 2 >= live_capacity) {
+        TraceEvent* old = live;
+        size_t old_capacity = live_capacity;
+        live_capacity = live_capacity ? live_capacity * 2 : 4096;
+        live = (TraceEvent*)calloc(live_capacity, sizeof(TraceEvent));
+        if (!live) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < old_capacity; i++)
+            if (old[i].ptr)
+                live[live_slot(old[i].ptr)] = old[i];
+        free(old);
+    }
+    size_t i = live_slot(ev->ptr);
+    num_live += !live[i].ptr;
+    live[i] = *ev;
+}
+
+// Remove a pointer if it's there, moving back whatever probed past it.
+static void live_erase(uint64_t ptr) {
+    if (!live_capacity)
+        return;
+    size_t i = live_slot(ptr), mask = live_capacity - 1;
+    if (!live[i].ptr)
+        return;
+    live[i].ptr = 0;
+    num_live--;
+    for (size_t j = (i + 1) & mask; live[j].ptr; j = (j + 1) & mask) {
+        TraceEvent moved = live[j];
+        live[j].ptr = 0;
+        live[live_slot(moved.ptr)] = moved;
+    }
+}
+
+// Changes to apply after the keyframe, with the order they were read in to break ties. A
+// realloc() is two: its old pointer going, as a free(), and its new one coming.
+struct Pending;
+typedef struct Pending Pending;
+struct Pending {
+    TraceEvent ev;
+    size_t order;
+};
+
+static Pending* pending;
+static size_t num_pending, pending_capacity;
+
+static void pend(TraceEvent* ev) {
+    if (num_pending == pending_capacity) {
+        pending_capacity = pending_capacity ? pending_capacity * 2 : 4096;
+        pending = (Pending*)realloc(pending, sizeof(Pending) * pending_capacity);
+        if (!pending) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+    pending[num_pending].ev = *ev;
+    pending[num_pending].order = num_pending;
+    num_pending++;
+}
+
+static int by_time(const void* a, const void* b) {
+    const Pending *x = (const Pending*)a, *y = (const Pending*)b;
+    if (x->ev.time != y->ev.time)
+        return x->ev.time < y->ev.time ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static int by_ptr(const void* a, const void* b) {
+    uint64_t x = ((const TraceEvent*)a)->ptr, y = ((const TraceEvent*)b)->ptr;
+    return x < y ? -1 : x > y;
+}
+
+static int heap_at(TraceReader* r, const char* path, uint64_t at, bool csv) {
+    if (trace_reader_keyframes(r)) {
+        fprintf(stderr, "%s: %s\n", path, r->error);
+        return 1;
+    }
+    size_t k = r->num_keyframes;
+    while (k && r->keyframes[k - 1].time > at)
+        k--;
+    if (k && trace_reader_seek(r, r->keyframes[k - 1].offset)) {
+        fprintf(stderr, "%s: %s\n", path, r->error);
+        return 1;
+    }
+
+    // Take the first keyframe read, then the changes from its time to at.
+    uint64_t from = 0;
+    bool in_keyframe = false, keyframed = !k;
+    TraceEvent ev;
+    int status;
+    while ((status = trace_reader_next(r, &ev)) == 1) {
+        if (ev.kind == TRACE_KEYFRAME) {
+            in_keyframe = !keyframed;
+            if (in_keyframe)
+                from = ev.time;
+            keyframed = true;
+        } else if (ev.kind == TRACE_KEYFRAME_END) {
+            in_keyframe = false;
+        } else if (ev.kind == TRACE_LIVE) {
+            if (in_keyframe)
+                live_put(&ev);
+        } else if (ev.time > at + SLACK_NS) {
+            break;
+        } else {
+            if (ev.kind == TRACE_REALLOC && ev.old_ptr && ev.old_time >= from && ev.old_time <= at) {
+                TraceEvent gone = ev;
+                gone.kind = TRACE_FREE;
+                gone.ptr = ev.old_ptr;
+                gone.time = ev.old_time;
+                pend(&gone);
+            }
+            if (ev.time >= from && ev.time <= at)
+                pend(&ev);
+        }
+    }
+    // A program that crashed can leave the last block cut short, so go on with what came before it.
+    if (status < 0)
+        fprintf(stderr, "%s: %s The live heap is from what came before that.\n", path, r->error);
+    if (in_keyframe) {
+        fprintf(stderr, "%s: The trace ends in the middle of a keyframe.\n", path);
+        return 1;
+    }
+
+    qsort(pending, num_pending, sizeof(Pending), by_time);
+    for (size_t i = 0; i < num_pending; i++) {
+        TraceEvent* p = &pending[i].ev;
+        if (p->kind == TRACE_FREE) {
+            live_erase(p->ptr);
+        } else {
+            p->kind = TRACE_LIVE;
+            live_put(p);
+        }
+    }
+    free(pending);
+
+    // Compact the table to print it in address order.
+    size_t n = 0;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < live_capacity; i++)
+        if (live[i].ptr)
+            live[n++] = live[i];
+    qsort(live, n, sizeof(TraceEvent), by_ptr);
+
+    if (csv)
+        printf("ptr,size,file,func,line\n");
+    for (size_t i = 0; i < n; i++) {
+        bytes += live[i].size;
+        if (csv) {
+            printf("0x%llx,%llu,", (unsigned long long)live[i].ptr, (unsigned long long)live[i].size);
+            print_csv_field(live[i].file);
+            putchar(',');
+            print_csv_field(live[i].func);
+            printf(",%llu\n", (unsigned long long)live[i].line);
+        } else {
+            printf("0x%llx, %llu bytes, from line %llu of %s() in %s.\n", (unsigned long long)live[i].ptr,
+                   (unsigned long long)live[i].size, (unsigned long long)live[i].line, live[i].func, live[i].file);
+        }
+    }
+    fprintf(stderr, "%zu live allocations totalling %llu bytes at %llu.%09llu, from the keyframe at %llu.%09llu and %zu changes.\n",
+            n, (unsigned long long)bytes, (unsigned long long)(at / 1000000000), (unsigned long long)(at % 1000000000),
+            (unsigned long long)(from / 1000000000), (unsigned long long)(from % 1000000000), num_pending);
+    free(live);
+    return status < 0;
+}
+
+static TraceReader reader;
+
+int main(int argc, char** argv) {
+    bool csv = false, rebuild = false;
+    uint64_t at = 0;
+    int i = 1;
+    for (; i < argc - 1; i++) {
+        if (!strcmp(argv[i], "--csv")) {
+            csv = true;
+        } else if (!strcmp(argv[i], "--at") && i + 1 < argc - 1) {
+            char* end;
+            double seconds = strtod(argv[++i], &end);
+            if (*end || !(seconds >= 0) || seconds > 1.8e10)
+                break;
+            at = (uint64_t)(seconds * 1e9);
+            rebuild = true;
+        } else {
+            break;
+        }
+    }
+    if (i != argc - 1) {
+        fprintf(stderr, "Usage: %s [--csv] [--at seconds] trace\n", argv[0]);
+        return 2;
+    }
+    const char* path = argv[i];
+    if (trace_reader_open(&reader, path)) {
+        fprintf(stderr, "%s: %s\n", path, reader.error);
+        return 1;
+    }
+    if (rebuild) {
+        int failed = heap_at(&reader, path, at, csv);
+        trace_reader_close(&reader);
+        return failed;
+    }
+
+    if (csv)
+        printf("time_ns,thread,event,ptr,old_ptr,size,file,func,line\n");
+    TraceEvent ev;
+    int status;
+    while ((status = trace_reader_next(&reader, &ev)) == 1) {
+        if (csv)
+            print_csv(&ev);
+        else
+            print_text(&ev);
+    }
+    if (status < 0)
+        fprintf(stderr, "%s: %s\n", path, reader.error);
+
+    fprintf(stderr, "%zu events in %llu bytes, %llu before compression, %.2f bytes per event.\n", reader.events,
+            (unsigned long long)reader.offset, (unsigned long long)reader.raw_bytes,
+            reader.events ? (double)reader.offset / (double)reader.events : 0.0);
+    trace_reader_close(&reader);
+    return status < 0;
+}
@@ -0,0 +1,560 @@
+#define _DEFAULT_SOURCE  // For -std=c99 and the like, before any system header
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memdebug_trace.h"
+
+// Replays the malloc()s, realloc()s and free()s in a trace from memdebug_trace_start() against
+// other allocators, to pick one by the program's own allocations rather than a synthetic load.
+// Each thread in the trace is replayed on a thread of its own, in its own order, waiting for
+// other threads only to free what they allocated. With --serial, everything is replayed on
+// one thread in time order instead. Every block is written to, a byte a page, so that it
+// counts towards the resident set.
+//
+// Each allocator runs in a forked child of its own, and gets the total time, the peak
+// resident set, and the fragmentation: how much of the resident set at its peak wasn't
+// holding live data, and the same at the end.
+//
+// Usage: ./trace_replay [--serial] [--backend name]... [--lib allocator.so] trace
+// The backends are glibc, arena and user, all of them by default. The user backend is a
+// shared library, from --lib, that exports replay_malloc(), replay_realloc() and replay_free(),
+// with the same arguments as malloc(), realloc() and free(). Or add one to backends below.
+// Linux only, for /proc/self/status. Build with -lpthread, and -ldl before glibc 2.34.
+
+struct ReplayAllocator;
+typedef struct ReplayAllocator ReplayAllocator;
+struct ReplayAllocator {
+    const char* name;
+    void (*setup)(size_t bytes);  // Given every byte the trace ever asks for. Can be NULL.
+    void* (*malloc)(size_t size);
+    void* (*realloc)(void* ptr, size_t size);
+    void (*free)(void* ptr);
+};
+
+/* glibc */
+
+static void* glibc_malloc(size_t size) { return malloc(size); }
+static void* glibc_realloc(void* ptr, size_t size) { return realloc(ptr, size); }
+static void glibc_free(void* ptr) { free(ptr); }
+
+/* Bump arena */
+
+// Hands out the next bytes of one big mapping and never reuses them, which is as fast as
+// allocation gets and as fragmented. Each block has its size in the 16 bytes before it.
+static uint8_t* arena;
+static atomic_size_t arena_used;
+static size_t arena_size;
+
+static void arena_setup(size_t bytes) {
+    arena_size = bytes;
+    arena = (uint8_t*)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena == MAP_FAILED) {
+        fprintf(stderr, "Could not map %zu bytes for the arena.\n", bytes);
+        exit(1);
+    }
+}
+
+static void* arena_malloc(size_t size) {
+    size_t at = atomic_fetch_add(&arena_used, 16 + ((size + 15) & ~(size_t)15));
+    if (at + 16 + size > arena_size)
+        return NULL;
+    *(size_t*)(arena + at) = size;
+    return arena + at + 16;
+}
+
+static void* arena_realloc(void* ptr, size_t size) {
+    void* moved = arena_malloc(size);
+    if (ptr && moved) {
+        size_t old = *(size_t*)((uint8_t*)ptr - 16);
+        memcpy(moved, ptr, old < size ? old : size);
+    }
+    return moved;
+}
+
+static void arena_free(void* ptr) { (void)ptr; }
+
+/* User allocator */
+
+static ReplayAllocator user;
+
+static bool user_load(const char* path) {
+    void* lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!lib) {
+        fprintf(stderr, "%s\n", dlerror());
+        return false;
+    }
+    user.name = "user";
+    *(void**)&user.malloc = dlsym(lib, "replay_malloc");
+    *(void**)&user.realloc = dlsym(lib, "replay_realloc");
+    *(void**)&user.free = dlsym(lib, "replay_free");
+    if (!user.malloc || !user.realloc || !user.free) {
+        fprintf(stderr, "%s doesn't export replay_malloc(), replay_realloc() and replay_free().\n", path);
+        return false;
+    }
+    return true;
+}
+
+static const ReplayAllocator backends[] = {
+    {"glibc", NULL, glibc_malloc, glibc_realloc, glibc_free},
+    {"arena", arena_setup, arena_malloc, arena_realloc, arena_free},
+};
+
+/*************************/
+/* Reading the Trace     */
+/*************************/
+
+// One call to replay. Allocations are numbered in the order they're made, from 1, so that
+// a free() can find what the malloc() it matches returned in this run.
+struct ReplayOp;
+typedef struct ReplayOp ReplayOp;
+struct ReplayOp {
+    uint8_t kind;     // TRACE_MALLOC, TRACE_REALLOC or TRACE_FREE
+    uint32_t id;      // Made, or freed
+    uint32_t old_id;  // Passed to realloc(), or 0 for NULL
+    uint64_t size;
+};
+
+// A point in time at which a pointer is taken or let go of. A realloc() is two.
+struct Change;
+typedef struct Change Change;
+struct Change {
+    uint64_t time;
+    size_t order;  // Of reading, to break ties, so each thread stays in its own order
+    size_t event;  // Index into events, or into initial for a live allocation from the keyframe
+    int part;      // 0 let go, 1 taken, 2 live at the keyframe
+};
+
+static TraceEvent* events;
+static size_t num_events;
+static TraceEvent* initial;  // Live when the trace started
+static size_t num_initial;
+
+static ReplayOp* ops;          // By event
+static ReplayOp* initial_ops;  // The ones made before replaying
+static size_t num_initial_ops;
+static size_t* serial;         // Indexes into ops, in time order, for --serial
+static size_t num_serial;
+static size_t num_threads;
+static size_t* thread_ops;    // Each thread's ops, as indexes into ops, in its order
+static size_t* thread_start;  // Where each thread's ops start in thread_ops, and one past the last
+static uint32_t num_ids;
+static uint64_t* sizes;  // By id
+static uint64_t peak_live, end_live, requested;
+static size_t unmatched;  // free()s and realloc()s of pointers the trace never saw
+
+static void* grow(void* array, size_t* capacity, size_t size) {
+    *capacity = *capacity ? *capacity * 2 : 4096;
+    array = realloc(array, *capacity * size);
+    if (!array) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    return array;
+}
+
+static int by_time(const void* a, const void* b) {
+    const Change *x = (const Change*)a, *y = (const Change*)b;
+    if (x->time != y->time)
+        return x->time < y->time ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/* Pointer map */
+
+// The id of each pointer live in the traced program, with linear probing. Pointers are never 0.
+struct MapEntry;
+typedef struct MapEntry MapEntry;
+struct MapEntry {
+    uint64_t ptr;
+    uint32_t id;
+};
+
+static MapEntry* map;
+static size_t map_capacity, map_count;
+
+static size_t map_slot(uint64_t ptr) {
+    size_t i = (size_t)((ptr >> 4) * 0x9E3779B97F4A7C15ULL) & (map_capacity - 1);
+    while (map[i].ptr && map[i].ptr != ptr)
+        i = (i + 1) & (map_capacity - 1);
+    return i;
+}
+
+static void map_put(uint64_t ptr, uint32_t id) {
+    if (map_count * 2 >= map_capacity) {
+        MapEntry* old = map;
+        size_t old_capacity = map_capacity;
+        map_capacity = map_capacity ? map_capacity * 2 : 4096;
+        map = (MapEntry*)calloc(map_capacity, sizeof(MapEntry));
+        if (!map) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < old_capacity; i++)
+            if (old[i].ptr)
+                map[map_slot(old[i].ptr)] = old[i];
+        free(old);
+    }
+    size_t i = map_slot(ptr);
+    map_count += !map[i].ptr;
+    map[i].ptr = ptr;
+    map[i].id = id;
+}
+
+// Remove a pointer, returning its id, or 0 if it isn't there.
+static uint32_t map_take(uint64_t ptr) {
+    if (!map_capacity || !ptr)
+        return 0;
+    size_t i = map_slot(ptr), mask = map_capacity - 1;
+    uint32_t id = map[i].id;
+    if (!map[i].ptr)
+        return 0;
+    map[i].ptr = 0;
+    map_count--;
+    for (size_t j = (i + 1) & mask; map[j].ptr; j = (j + 1) & mask) {
+        MapEntry moved = map[j];
+        map[j].ptr = 0;
+        map[map_slot(moved.ptr)] = moved;
+    }
+    return id;
+}
+
+static uint32_t new_id(uint64_t size, uint64_t* live) {
+    static size_t capacity;
+    if (++num_ids >= capacity)
+        sizes = (uint64_t*)grow(sizes, &capacity, sizeof(uint64_t));
+    sizes[num_ids] = size;
+    *live += size;
+    if (*live > peak_live)
+        peak_live = *live;
+    requested += size;
+    return num_ids;
+}
+
+// Read every event, and what was live at the first keyframe, and number the allocations by
+// going through when each pointer was taken and let go of in time order, as the keyframes do.
+static int load(const char* path) {
+    static TraceReader reader;
+    if (trace_reader_open(&reader, path)) {
+        fprintf(stderr, "%s: %s\n", path, reader.error);
+        return 1;
+    }
+    size_t events_capacity = 0, initial_capacity = 0;
+    int keyframes = 0;
+    uint64_t keyframe_time = 0;
+    TraceEvent ev;
+    int status;
+    while ((status = trace_reader_next(&reader, &ev)) == 1) {
+        keyframes += ev.kind == TRACE_KEYFRAME;
+        if (ev.kind == TRACE_KEYFRAME && keyframes == 1)
+            keyframe_time = ev.time;
+        if (ev.kind == TRACE_LIVE && keyframes == 1) {
+            if (num_initial == initial_capacity)
+                initial = (TraceEvent*)grow(initial, &initial_capacity, sizeof(TraceEvent));
+            initial[num_initial++] = ev;
+        } else if (ev.kind <= TRACE_FREE) {
+            if (num_events == events_capacity)
+                events = (TraceEvent*)grow(events, &events_capacity, sizeof(TraceEvent));
+            events[num_events++] = ev;
+        }
+    }
+    if (status < 0)
+        fprintf(stderr, "%s: %s Replaying what came before that.\n", path, reader.error);
+    trace_reader_close(&reader);
+
+    size_t num_changes = 0, changes_capacity = 0;
+    Change* changes = NULL;
+    for (size_t i = 0; i < num_initial; i++) {
+        if (num_changes == changes_capacity)
+            changes = (Change*)grow(changes, &changes_capacity, sizeof(Change));
+        changes[num_changes++] = (Change){keyframe_time, num_changes, i, 2};
+    }
+    for (size_t i = 0; i < num_events; i++) {
+        if (num_changes + 2 > changes_capacity)
+            changes = (Change*)grow(changes, &changes_capacity, sizeof(Change));
+        if (events[i].kind != TRACE_MALLOC)
+            changes[num_changes++] = (Change){events[i].kind == TRACE_REALLOC ? events[i].old_time : events[i].time,
+                                              num_changes, i, 0};
+        if (events[i].kind != TRACE_FREE)
+            changes[num_changes++] = (Change){events[i].time, num_changes, i, 1};
+    }
+    qsort(changes, num_changes, sizeof(Change), by_time);
+
+    // What the keyframe saw, unless the events already had it, then the events.
+    ops = (ReplayOp*)calloc(num_events + 1, sizeof(ReplayOp));
+    initial_ops = (ReplayOp*)calloc(num_initial + 1, sizeof(ReplayOp));
+    serial = (size_t*)calloc(num_events + 1, sizeof(size_t));
+    if (!ops || !initial_ops || !serial) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    uint64_t live = 0;
+    for (size_t c = 0; c < num_changes; c++) {
+        Change* ch = &changes[c];
+        if (ch->part == 2) {
+            TraceEvent* in = &initial[ch->event];
+            if (map_capacity && map[map_slot(in->ptr)].ptr)
+                continue;
+            ReplayOp* op = &initial_ops[num_initial_ops++];
+            op->kind = TRACE_MALLOC;
+            op->size = in->size;
+            op->id = new_id(in->size, &live);
+            map_put(in->ptr, op->id);
+            continue;
+        }
+        TraceEvent* e = &events[ch->event];
+        ReplayOp* op = &ops[ch->event];
+        op->kind = (uint8_t)e->kind;
+        if (ch->part == (e->kind == TRACE_FREE ? 0 : 1))
+            serial[num_serial++] = ch->event;
+        if (ch->part == 1) {
+            op->size = e->size;
+            op->id = new_id(e->size, &live);
+            map_put(e->ptr, op->id);
+        } else {
+            uint32_t id = map_take(e->kind == TRACE_REALLOC ? e->old_ptr : e->ptr);
+            if (id)
+                live -= sizes[id];
+            else if (e->kind == TRACE_FREE ? e->ptr : e->old_ptr)
+                unmatched++;
+            if (e->kind == TRACE_FREE)
+                op->id = id;
+            else
+                op->old_id = id;
+        }
+    }
+    end_live = live;
+    free(changes);
+    free(initial);
+
+    // Each thread's ops, in the order they were read, which is the order the thread made them.
+    uint32_t max_thread = 0;
+    for (size_t i = 0; i < num_events; i++)
+        if (events[i].thread > max_thread)
+            max_thread = events[i].thread;
+    size_t* index = (size_t*)calloc((size_t)max_thread + 1, sizeof(size_t));
+    size_t* count = (size_t*)calloc((size_t)max_thread + 2, sizeof(size_t));
+    for (size_t i = 0; i < num_events; i++)
+        count[events[i].thread]++;
+    thread_start = (size_t*)calloc((size_t)max_thread + 2, sizeof(size_t));
+    for (uint32_t t = 0; t <= max_thread; t++) {
+        if (!count[t])
+            continue;
+        index[t] = num_threads;
+        thread_start[num_threads + 1] = thread_start[num_threads] + count[t];
+        num_threads++;
+    }
+    thread_ops = (size_t*)calloc(num_events + 1, sizeof(size_t));
+    memset(count, 0, sizeof(size_t) * ((size_t)max_thread + 2));
+    for (size_t i = 0; i < num_events; i++) {
+        size_t t = index[events[i].thread];
+        thread_ops[thread_start[t] + count[t]++] = i;
+    }
+    free(index);
+    free(count);
+    free(events);
+    return status < 0;
+}
+
+/*************************/
+/* Replaying             */
+/*************************/
+
+static const ReplayAllocator* backend;
+static _Atomic(void*)* slots;    // What each id got in this run
+static pthread_barrier_t ready;  // The worker threads and run(), once the baseline is taken
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Wait for another thread to have made an allocation, if it hasn't yet.
+static void* wait_for(uint32_t id) {
+    void* ptr;
+    for (unsigned spins = 0; !(ptr = atomic_load_explicit(&slots[id], memory_order_acquire)); spins++)
+        if (spins >= 64)
+            sched_yield();
+    return ptr;
+}
+
+static void replay_op(const ReplayOp* op) {
+    void* ptr;
+    if (op->kind == TRACE_FREE) {
+        if (op->id)
+            backend->free(wait_for(op->id));
+        return;
+    }
+    // memdebug treats a NULL from malloc() as out of memory, so every block the trace has was
+    // a real one. Asking for at least a byte gets one here too.
+    size_t size = op->size ? (size_t)op->size : 1;
+    if (op->kind == TRACE_MALLOC)
+        ptr = backend->malloc(size);
+    else
+        ptr = backend->realloc(op->old_id ? wait_for(op->old_id) : NULL, size);
+    if (!ptr) {
+        fprintf(stderr, "%s ran out of memory.\n", backend->name);
+        exit(1);
+    }
+    for (size_t i = 0; i < size; i += 4096)
+        ((volatile uint8_t*)ptr)[i] = 1;
+    atomic_store_explicit(&slots[op->id], ptr, memory_order_release);
+}
+
+static void* replay_thread(void* arg) {
+    size_t t = (size_t)arg;
+    pthread_barrier_wait(&ready);
+    for (size_t i = thread_start[t]; i < thread_start[t + 1]; i++)
+        replay_op(&ops[thread_ops[i]]);
+    return NULL;
+}
+
+// A field of /proc/self/status, in bytes.
+static uint64_t status_bytes(const char* field) {
+    char line[256];
+    size_t len = strlen(field);
+    unsigned long long kb = 0;
+    FILE* status = fopen("/proc/self/status", "r");
+    while (status && fgets(line, sizeof(line), status))
+        if (!strncmp(line, field, len) && line[len] == ':')
+            sscanf(line + len + 1, "%llu", &kb);
+    if (status)
+        fclose(status);
+    return (uint64_t)kb * 1024;
+}
+
+static double fragmentation(uint64_t rss, uint64_t live) {
+    return rss > live ? 100.0 * (double)(rss - live) / (double)rss : 0.0;
+}
+
+// Replay the whole trace, in a child of its own so that each allocator starts from nothing.
+static int run(const ReplayAllocator* allocator, bool in_order) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid) {
+        int status;
+        waitpid(pid, &status, 0);
+        return !WIFEXITED(status) || WEXITSTATUS(status);
+    }
+
+    backend = allocator;
+    slots = (_Atomic(void*)*)calloc((size_t)num_ids + 1, sizeof(void*));
+    pthread_t* workers = (pthread_t*)calloc(num_threads + 1, sizeof(pthread_t));
+    if (!slots || !workers) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    // The harness's own memory goes in the baseline: the slots, touched a page at a time since
+    // calloc() leaves them unmapped, and the worker threads' stacks, started and left waiting.
+    for (size_t i = 0; i < ((size_t)num_ids + 1) * sizeof(void*); i += 4096)
+        ((volatile uint8_t*)slots)[i] = 0;
+    if (!in_order) {
+        pthread_barrier_init(&ready, NULL, (unsigned)num_threads + 1);
+        for (size_t t = 0; t < num_threads; t++)
+            if (pthread_create(&workers[t], NULL, replay_thread, (void*)t)) {
+                fprintf(stderr, "Could not start a thread.\n");
+                exit(1);
+            }
+    }
+
+    // Start the peak over, then measure from what's already resident.
+    FILE* clear = fopen("/proc/self/clear_refs", "w");
+    if (clear) {
+        fputs("5", clear);
+        fclose(clear);
+    }
+    uint64_t base = status_bytes("VmRSS");
+    if (backend->setup)
+        backend->setup((size_t)(requested + 32 * (uint64_t)num_ids + 4096));
+    for (size_t i = 0; i < num_initial_ops; i++)
+        replay_op(&initial_ops[i]);
+
+    uint64_t start = now_ns();
+    if (in_order) {
+        for (size_t i = 0; i < num_serial; i++)
+            replay_op(&ops[serial[i]]);
+    } else {
+        pthread_barrier_wait(&ready);
+        for (size_t t = 0; t < num_threads; t++)
+            pthread_join(workers[t], NULL);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    uint64_t peak = status_bytes("VmHWM"), end = status_bytes("VmRSS");
+    peak = peak > base ? peak - base : 0;
+    end = end > base ? end - base : 0;
+    printf("%-6s %9.1f ms %7.1f ns per call, peak RSS %9.2f MB, fragmentation %5.1f%% at the peak, %5.1f%% at the end (%.2f MB RSS)\n",
+           backend->name, (double)elapsed / 1e6, (double)elapsed / (double)(num_serial ? num_serial : 1),
+           (double)peak / 1e6, fragmentation(peak, peak_live), fragmentation(end, end_live), (double)end / 1e6);
+    fflush(stdout);
+    _exit(0);
+}
+
+int main(int argc, char** argv) {
+    bool in_order = false;
+    const char* lib = NULL;
+    const char* wanted[8];
+    size_t num_wanted = 0;
+    int i = 1;
+    for (; i < argc - 1; i++) {
+        if (!strcmp(argv[i], "--serial"))
+            in_order = true;
+        else if (!strcmp(argv[i], "--backend") && i + 1 < argc - 1 && num_wanted < 8)
+            wanted[num_wanted++] = argv[++i];
+        else if (!strcmp(argv[i], "--lib") && i + 1 < argc - 1)
+            lib = argv[++i];
+        else
+            break;
+    }
+    if (i != argc - 1) {
+        fprintf(stderr, "Usage: %s [--serial] [--backend glibc|arena|user]... [--lib allocator.so] trace\n", argv[0]);
+        return 2;
+    }
+    if (lib && !user_load(lib))
+        return 1;
+
+    const char* path = argv[i];
+    int failed = load(path);
+    if (!num_serial) {
+        fprintf(stderr, "%s: There's nothing to replay.\n", path);
+        return 1;
+    }
+    printf("%s: %zu calls on %zu thread%s, %zu allocations live at the start. Live at the peak %.2f MB, at the end %.2f MB.\n",
+           path, num_serial, num_threads, num_threads == 1 ? "" : "s", num_initial_ops,
+           (double)peak_live / 1e6, (double)end_live / 1e6);
+    if (unmatched)
+        printf("%zu free()s and realloc()s are of pointers the trace doesn't have, and are replayed as no-ops or malloc()s.\n",
+               unmatched);
+
+    size_t ran = 0;
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]) + 1; b++) {
+        const ReplayAllocator* allocator = b < sizeof(backends) / sizeof(backends[0]) ? &backends[b] : &user;
+        bool chosen = !num_wanted && allocator->name;
+        for (size_t w = 0; w < num_wanted; w++)
+            chosen |= allocator->name && !strcmp(wanted[w], allocator->name);
+        if (!chosen)
+            continue;
+        failed |= run(allocator, in_order);
+        ran++;
+    }
+    for (size_t w = 0; w < num_wanted; w++)
+        if (!strcmp(wanted[w], "user") && !lib) {
+            fprintf(stderr, "The user backend needs --lib.\n");
+            failed = 1;
+        }
+    if (!ran && !failed) {
+        fprintf(stderr, "No backend called that.\n");
+        failed = 1;
+    }
+    return failed;
+}